@@ -15,6 +15,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -22,6 +23,7 @@
 #include <sys/times.h>
 #include <sys/select.h>
 #include <sys/syscall.h>
+#include <pthread.h>
 
 #include "aio.h"
 
@@ -32,6 +34,10 @@ extern int sigqueue(pid_t, int, const union sigval);
 
 #else
 
+#ifndef EFD_SEMAPHORE
+#define EFD_SEMAPHORE 1
+#endif
+
 #ifndef __NR_eventfd2
 #define __NR_eventfd2 (__NR_SYSCALL_BASE + 356)
 #endif
@@ -55,20 +61,69 @@ int sigqueue(pid_t pid, int sig, const union sigval value)
 
 #endif
 
+/* kernel 4.18+ takes an I/O priority per iocb */
+#ifndef IOCB_FLAG_IOPRIO
+#define IOCB_FLAG_IOPRIO (1 << 1)
+#endif
+
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+/* USDT probes (provider "aio") for perf and bpftrace, see tools/. Each is a
+ * single nop until a tracer attaches; without <sys/sdt.h> (systemtap-sdt-dev)
+ * or with -DAIO_NO_PROBES there are none.
+ */
+#if defined(__has_include) && !defined(AIO_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AIO_HAVE_PROBES
+#endif
+#endif
+
+#ifdef AIO_HAVE_PROBES
+#define AIO_PROBE3(name, a, b, c) DTRACE_PROBE3(aio, name, a, b, c)
+#define AIO_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(aio, name, a, b, c, d, e)
+#else
+#define AIO_PROBE3(name, a, b, c) do {} while (0)
+#define AIO_PROBE5(name, a, b, c, d, e) do {} while (0)
+#endif
+
+/* Probes on a request: aiocb, fd, offset, size and result */
+#define AIO_PROBE_CTX(name, c, res) \
+	AIO_PROBE5(name, (c)->aiocbp, (c)->aio_fildes, (long long)(c)->iocb.aio_offset, \
+	           (long long)(c)->iocb.aio_nbytes, (long long)(res))
+
 extern int fsync(int);
 extern int kill(pid_t, int);
+#ifdef ANDROID
 extern int pselect(int, fd_set *, fd_set *, fd_set *, const struct timespec *, const sigset_t *);
+#endif
 
 
-/* Enough for default systems. See /proc/sys/kernel/pid_max .
- * The sys_clone() is using PID allocation functions to find next
- * free TID, so gettid() should not return values larger than
- * pid_max either. If you adjust your pid_max for whatever reason,
- * make sure you do so here.
+/* Number of per-thread context lists. One per TID on default systems,
+ * see /proc/sys/kernel/pid_max . With a larger pid_max, threads share
+ * a list by TID modulo TID_MAX; requests are found by their ctx_id, so
+ * that only costs longer lists.
  */
 
 static const int TID_MAX = 33000;
-static char __child_stack[4096];
+
+/* ThreadSanitizer is told that the kernel orders io_submit() of a node
+ * before io_getevents() handing it out to the watcher.
+ */
+#ifdef __SANITIZE_THREAD__
+extern void __tsan_acquire(void *);
+extern void __tsan_release(void *);
+#define TSAN_ACQUIRE(p) __tsan_acquire(p)
+#define TSAN_RELEASE(p) __tsan_release(p)
+#else
+#define TSAN_ACQUIRE(p) do {} while (0)
+#define TSAN_RELEASE(p) do {} while (0)
+#endif
 
 /* We want a reader/writer lock. Of the uin32_t integer lock value
  * the lower 16 bits count the number of writers holding a lock and
@@ -82,253 +137,1672 @@ enum {
 	CTX_LOCKED_R		= (1<<16),
 	CTX_WLOCKED_MASK	= CTX_LOCKED_R - 1,
 
-	AIO_UNINITIALIZED	= 0,
-	AIO_INITIALIZING	= 1,
-	AIO_INITIALIZED		= 2
-};
+	AIO_UNINITIALIZED	= 0,
+	AIO_INITIALIZING	= 1,
+	AIO_INITIALIZED		= 2,
+
+	/* upper bound of hook worker threads */
+	WORKERS_MAX		= 16,
+
+	/* where a request is, as far as the scheduler is concerned */
+	CTX_NEW			= 0,
+	CTX_QUEUED		= 1,
+	CTX_INKERNEL		= 2,
+	CTX_REAPED		= 3,
+	CTX_CHAINED		= 4,	/* waits for the previous step of its chain */
+
+	/* aio_reqprio 0..AIO_PRIO_IDLE */
+	PRIO_LEVELS		= AIO_PRIO_IDLE + 1,
+
+	/* default for aio_sched_depth() */
+	SCHED_DEPTH		= 32,
+
+	/* events of the kernel context, and the default process limit */
+	SCHED_MAX		= 1024,
+
+	/* completions fetched by the watcher at once */
+	EVENTS_BATCH		= 64,
+
+	/* plugged requests that are submitted in one go */
+	PLUG_MAX		= 32
+};
+
+/* The node of a context list per thread. All requests go to the kernel
+ * thru one context (__kctx), ctx_id just identifies the request.
+ */
+struct __ctx {
+	aio_context_t ctx_id;
+	int aio_fildes, efd;
+	pid_t tid;
+	struct sigevent aio_sigevent;
+	long int aio_return;
+	int aio_error;
+	struct iocb iocb;
+	struct __ctx *next;
+
+	/* completion hook, run by the worker pool */
+	struct aiocb *aiocbp;
+	aio_hook_t hook;
+	void *hook_arg;
+	long int hook_res;
+	int hooked;
+	struct __ctx *work_next;
+
+	/* scheduling: level, CTX_* state and CLOCK_MONOTONIC deadline in ns */
+	int prio, state;
+	int64_t deadline;
+	struct __ctx *sched_next;
+
+	/* the deadline list, under __sched_lock */
+	struct __ctx *dl_prev, *dl_next;
+
+	/* the fd index, and aio_cancel() calls working on it right now */
+	struct __ctx *fd_prev, *fd_next;
+	int pins;
+
+	/* the lio_listio() or aio_chain() list c belongs to, if any */
+	struct __lio *lio;
+
+	/* aio_chain(): the steps after and before c, changed under
+	 * __sched_lock
+	 */
+	struct __ctx *chain_next, *chain_prev;
+};
+
+/* A lio_listio() or aio_chain() list. It counts its members down as they
+ * finish; the last one wakes the LIO_WAIT caller via efd or sends the list's
+ * notification and frees it.
+ */
+struct __lio {
+	int pending, mode, efd;
+	pid_t tid;
+	struct sigevent sig;
+};
+
+
+/* atomics, concurrently accessed */
+static int __init_lock = AIO_UNINITIALIZED;
+static struct __ctx **__ctxs = NULL;
+static uint32_t *__ctx_locks = NULL;
+
+/* non-atomics, only accessed reading not not at all */
+static aio_context_t __kctx = 0;
+static int __kctx_size = 0;
+
+/* Queue of completed requests whose hook has to be run. The watcher
+ * appends and signals __work_event_fd (a semaphore, one count per node).
+ */
+static int __pool_init = AIO_UNINITIALIZED;
+static int __work_event_fd = -1;
+static int __work_lock = 0;
+static struct __ctx *__work_head = NULL, *__work_tail = NULL;
+
+/* Requests wait in a FIFO per level while the process or fd limit, or the
+ * budget for aio_reqprio > 0, is used up. All of it is protected by
+ * __sched_lock. __fds is indexed by fd and grows on demand. It also lists
+ * every request of the fd, of any thread, until aio_return(), so that
+ * aio_cancel() neither needs the list of the submitting thread nor walks
+ * the requests of other fds.
+ */
+struct __fd_sched {
+	int limit, inflight, queued;
+	struct __ctx *reqs;
+	int nreqs;
+
+	/* aio_rate_tag() + 1, 0 if untagged */
+	int rate;
+};
+
+/* Token buckets of aio_rate_limit(), in bytes and requests. They refill
+ * whenever they are looked at. Also protected by __sched_lock. A scan of
+ * the queues keeps one bit per tag, so there are at most 64.
+ */
+struct __rate {
+	struct aio_rate conf;
+	double bytes, ops;
+	int64_t stamp;
+};
+
+static int __sched_lock = 0;
+static struct __ctx *__sched_head[PRIO_LEVELS], *__sched_tail[PRIO_LEVELS];
+static int __sched_inflight[PRIO_LEVELS];
+static int __sched_depth = SCHED_DEPTH;
+static int __sched_max = 0, __sched_total = 0, __sched_queued = 0;
+static struct __fd_sched *__fds = NULL;
+static int __nfds = 0;
+static int __ioprio_ok = 1;
+static struct __rate __rates[AIO_RATE_TAGS];
+
+/* Earliest armed deadline (0 if none), and the fd to wake the watcher if
+ * it has to sleep shorter.
+ */
+static int64_t __next_deadline = 0;
+static int __wake_fd = -1;
+
+/* Requests with a deadline, earliest first, so the watcher only looks at
+ * the expired ones. Protected by __sched_lock; c->deadline is 0 for those
+ * not on it.
+ */
+static struct __ctx *__dl_head = NULL, *__dl_tail = NULL;
+
+/* When throttled requests have enough tokens again (0 if there are none) */
+static int64_t __next_refill = 0;
+
+/* Requests of a thread between aio_plug() and aio_unplug(). They are
+ * admitted by the scheduler already (CTX_INKERNEL) but not yet submitted.
+ * The watcher's own stays empty.
+ */
+static __thread struct {
+	int depth, n;
+	struct __ctx *ctxs[PLUG_MAX];
+} __plug;
+
+
+static inline uint32_t ctx_slot(pid_t tid)
+{
+	return (uint32_t)tid % TID_MAX;
+}
+
+
+/* The locks acquire on taking and release on dropping; everything else on
+ * the lists is ordered by them. Contended, they spin on plain loads rather
+ * than locked instructions, so waiters do not steal the cache line from the
+ * holder.
+ */
+static struct __ctx *get_ctx_list_lock_w(pid_t tid)
+{
+	uint32_t *l = __ctx_locks + ctx_slot(tid);
+
+	/* writers are exclusive i.e. there must be no lock at all */
+	while (__atomic_fetch_add(l, CTX_LOCKED_W, __ATOMIC_ACQUIRE) != CTX_UNLOCKED) {
+		__atomic_fetch_sub(l, CTX_LOCKED_W, __ATOMIC_RELAXED);
+		while (__atomic_load_n(l, __ATOMIC_RELAXED) != CTX_UNLOCKED)
+			;
+	}
+	return __ctxs[ctx_slot(tid)];
+}
+
+
+static struct __ctx *get_ctx_list_lock_r(pid_t tid)
+{
+	uint32_t *l = __ctx_locks + ctx_slot(tid);
+
+	/* any writer lock (i.e. any of the lower 16 bits set)? */
+	while (__atomic_fetch_add(l, CTX_LOCKED_R, __ATOMIC_ACQUIRE) & CTX_WLOCKED_MASK) {
+		__atomic_fetch_sub(l, CTX_LOCKED_R, __ATOMIC_RELAXED);
+		while (__atomic_load_n(l, __ATOMIC_RELAXED) & CTX_WLOCKED_MASK)
+			;
+	}
+	return __ctxs[ctx_slot(tid)];
+}
+
+
+static void put_ctx_list_lock_r(pid_t tid)
+{
+	__atomic_fetch_sub(__ctx_locks + ctx_slot(tid), CTX_LOCKED_R, __ATOMIC_RELEASE);
+}
+
+
+static void put_ctx_list_lock_w(pid_t tid)
+{
+	__atomic_fetch_sub(__ctx_locks + ctx_slot(tid), CTX_LOCKED_W, __ATOMIC_RELEASE);
+}
+
+
+/* The callback of a SIGEV_THREAD notification, on a thread of its own */
+struct __sigev_thread {
+	void (*fn)(union sigval);
+	union sigval value;
+};
+
+
+static void *sigev_thread(void *vp)
+{
+	struct __sigev_thread t = *(struct __sigev_thread *)vp;
+
+	free(vp);
+	t.fn(t.value);
+	return NULL;
+}
+
+
+/* What notify_sigev() can deliver */
+static int sigev_valid(const struct sigevent *sev)
+{
+	switch (sev->sigev_notify) {
+	case SIGEV_NONE:
+		return 1;
+	case SIGEV_SIGNAL:
+		return sev->sigev_signo >= 0 && sev->sigev_signo < _NSIG;
+	case SIGEV_THREAD:
+		return sev->sigev_notify_function != NULL;
+	default:
+		return 0;
+	}
+}
+
+
+/* Deliver sev for a request or list of thread tid. SIGEV_SIGNAL with a
+ * signo of 0 sends nothing, as aiocbs are often just zeroed. Like glibc,
+ * a SIGEV_THREAD callback runs detached unless sigev_notify_attributes
+ * says otherwise. Errors dont matter, there is no one to report them to.
+ */
+static void notify_sigev(const struct sigevent *sev, pid_t tid)
+{
+	struct __sigev_thread *t = NULL;
+	pthread_attr_t attr, *pattr = NULL;
+	pthread_t pt;
+
+	if (sev->sigev_notify == SIGEV_SIGNAL && sev->sigev_signo != 0) {
+		sigqueue(tid, sev->sigev_signo, sev->sigev_value);
+		return;
+	}
+	if (sev->sigev_notify != SIGEV_THREAD || (t = malloc(sizeof(*t))) == NULL)
+		return;
+	t->fn = sev->sigev_notify_function;
+	t->value = sev->sigev_value;
+	if ((pattr = (pthread_attr_t *)sev->sigev_notify_attributes) == NULL) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pattr = &attr;
+	}
+	if (pthread_create(&pt, pattr, sigev_thread, t) != 0)
+		free(t);
+	if (pattr == &attr)
+		pthread_attr_destroy(&attr);
+}
+
+
+static int notify_finished(struct __ctx *c)
+{
+	int64_t one = 1;
+
+	/* If a event fd is registered in the ctx struct, someone is on
+	 * aio_suspend(), so notify this sleeping thread via event fd.
+	 * aio_suspend() sets and resets c->efd under a writer lock, so it
+	 * stays open while we hold our reader lock.
+	 */
+	int fd = __atomic_load_n(&c->efd, __ATOMIC_RELAXED);
+	if (fd > 0)
+		write(fd, &one, sizeof(one));
+
+	notify_sigev(&c->aio_sigevent, c->tid);
+	return 0;
+}
+
+
+/* A member of l finished, or will never start */
+static void lio_put(struct __lio *l)
+{
+	int64_t one = 1;
+
+	/* the last one reads what the others wrote */
+	if (__atomic_sub_fetch(&l->pending, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (l->mode == LIO_WAIT) {
+		write(l->efd, &one, sizeof(one));
+		return;
+	}
+	/* nobody looks at a LIO_NOWAIT list after its last member */
+	notify_sigev(&l->sig, l->tid);
+	free(l);
+}
+
+
+static void chain_advance(struct __ctx *c, long int res, int err);
+
+/* Make the result of a request visible, in the node and in the caller's
+ * aiocb for aio_error_fast(). aio_error is written last and with release
+ * semantics, in the node and in the aiocb, so whoever sees it also sees
+ * aio_return. Since we only have a readlock for c, the node's assignments
+ * need to be atomic. Caller holds a reader lock on c's list, so aio_suspend()
+ * can not miss the notification and aio_return() can not free c meanwhile.
+ */
+static void publish(struct __ctx *c, long int res, int err)
+{
+	long int inited = -1;
+	int busy = EINPROGRESS;
+
+	/* atomic 'c->aio_return = res;' (must have been inited with -1) */
+	__atomic_compare_exchange_n(&c->aio_return, &inited, res, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	/* c->aio_error = err; unless someone was faster (deadline) */
+	if (!__atomic_compare_exchange_n(&c->aio_error, &busy, err, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		return;
+	c->aiocbp->aio_return = res;
+	__atomic_store_n(&c->aiocbp->aio_error, err, __ATOMIC_RELEASE);
+	AIO_PROBE_CTX(notify, c, res);
+	notify_finished(c);
+	if (__atomic_load_n(&c->chain_next, __ATOMIC_RELAXED))
+		chain_advance(c, res, err);
+	if (c->lio)
+		lio_put(c->lio);
+}
+
+
+static void work_lock(void)
+{
+	while (__atomic_exchange_n(&__work_lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+
+static void work_unlock(void)
+{
+	__atomic_store_n(&__work_lock, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Called by the watcher */
+static void queue_work(struct __ctx *c)
+{
+	int64_t one = 1;
+
+	c->work_next = NULL;
+	work_lock();
+	if (__work_tail)
+		__work_tail->work_next = c;
+	else
+		__work_head = c;
+	__work_tail = c;
+	work_unlock();
+	write(__work_event_fd, &one, sizeof(one));
+}
+
+
+/* Make the result of a hooked request visible. Caller holds a reader lock
+ * on c's list, for the same reason the watcher does.
+ */
+static void hook_finish(struct __ctx *c, int err)
+{
+	if (err == 0 && c->hook_res < 0)
+		err = -(int)c->hook_res;
+	publish(c, c->hook_res, err);
+}
+
+
+static void *__aio_worker(void *vp)
+{
+	int64_t i64 = 0;
+	int r = 0;
+	pid_t tid = 0;
+	struct __ctx *c = NULL;
+
+	for (;;) {
+		if (read(__work_event_fd, &i64, sizeof(i64)) < 0)
+			continue;
+
+		work_lock();
+		if ((c = __work_head) != NULL) {
+			if ((__work_head = c->work_next) == NULL)
+				__work_tail = NULL;
+		}
+		work_unlock();
+		if (!c)
+			continue;
+
+		/* c can not go away until we publish the result */
+		if ((r = c->hook(c->aiocbp, c->hook_res, c->hook_arg)) == AIO_HOOK_DEFER)
+			continue;
+		tid = c->tid;
+		get_ctx_list_lock_r(tid);
+		hook_finish(c, r);
+		put_ctx_list_lock_r(tid);
+	}
+	return NULL;
+}
+
+
+static int __aio_pool_init(void)
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	long int n = 0, i = 0, started = 0;
+
+	int state = AIO_UNINITIALIZED;
+
+	if (!__atomic_compare_exchange_n(&__pool_init, &state, AIO_INITIALIZING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&__pool_init, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
+			sched_yield();
+		return __work_event_fd < 0 ? -1 : 0;
+	}
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+	if (n > WORKERS_MAX)
+		n = WORKERS_MAX;
+
+	if ((__work_event_fd = eventfd(0, EFD_SEMAPHORE)) >= 0) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		for (i = 0; i < n; ++i) {
+			if (pthread_create(&t, &attr, __aio_worker, NULL) == 0)
+				++started;
+		}
+		pthread_attr_destroy(&attr);
+		if (!started) {
+			close(__work_event_fd);
+			__work_event_fd = -1;
+		}
+	}
+
+	__atomic_store_n(&__pool_init, AIO_INITIALIZED, __ATOMIC_RELEASE);
+	return __work_event_fd < 0 ? -1 : 0;
+}
+
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+static void sched_lock(void)
+{
+	while (__atomic_exchange_n(&__sched_lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+
+static void sched_unlock(void)
+{
+	__atomic_store_n(&__sched_lock, 0, __ATOMIC_RELEASE);
+}
+
+
+/* aio_reqprio lowers the priority: 1..3 map to the best-effort levels below
+ * the default of 4, anything from AIO_PRIO_IDLE on to the idle class. Only
+ * few I/O schedulers (BFQ) look at it; the userspace budget works anyway.
+ */
+static void set_ioprio(struct iocb *iocbp, int prio)
+{
+	int level = 4 + prio;
+
+	if (prio == 0 || !__ioprio_ok)
+		return;
+	if (level > 7)
+		level = 7;
+	if (prio >= AIO_PRIO_IDLE)
+		iocbp->aio_reqprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+	else
+		iocbp->aio_reqprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+	iocbp->aio_flags |= IOCB_FLAG_IOPRIO;
+}
+
+
+/* Returns 0 or -errno, the callers decide what goes to errno */
+static int ctx_submit(struct __ctx *c)
+{
+	struct iocb *iocbp = &c->iocb;
+	int r = 0;
+
+	/* before, c may be gone once the kernel has it */
+	AIO_PROBE_CTX(io_submit, c, 0);
+	TSAN_RELEASE(c);
+	if ((r = syscall(__NR_io_submit, __kctx, 1, &iocbp)) < 0) {
+		r = -errno;
+		/* kernel too old for IOCB_FLAG_IOPRIO */
+		if (r == -EINVAL && (iocbp->aio_flags & IOCB_FLAG_IOPRIO)) {
+			__ioprio_ok = 0;
+			iocbp->aio_flags &= ~IOCB_FLAG_IOPRIO;
+			iocbp->aio_reqprio = 0;
+			if ((r = syscall(__NR_io_submit, __kctx, 1, &iocbp)) < 0)
+				r = -errno;
+		}
+	}
+	return r < 0 ? r : 0;
+}
+
+
+/* Make sure __fds covers 'fd'. Returns 0, -EBADF for an fd which is not
+ * open, so a bogus one does not size the table, or -ENOMEM. Called with
+ * __sched_lock held.
+ */
+static int fd_grow(int fd)
+{
+	struct __fd_sched *f = NULL;
+	size_t n = __nfds ? __nfds : 64;
+
+	if (fd < __nfds)
+		return 0;
+	if (fcntl(fd, F_GETFD) < 0)
+		return -EBADF;
+	while (n <= (size_t)fd)
+		n *= 2;
+	if (n > INT_MAX)
+		n = (size_t)fd + 1;
+	if ((f = realloc(__fds, n*sizeof(*f))) == NULL)
+		return -ENOMEM;
+	memset(f + __nfds, 0, (n - __nfds)*sizeof(*f));
+	__fds = f;
+	__nfds = n;
+	return 0;
+}
+
+
+/* Lower the timer '*t' (a CLOCK_MONOTONIC ns value, 0 if unarmed) to 'when'.
+ * Returns 1 if it was lowered.
+ */
+static int sched_timer(int64_t *t, int64_t when)
+{
+	int64_t old = 0;
+
+	old = __atomic_load_n(t, __ATOMIC_SEQ_CST);
+	do {
+		if (old != 0 && old <= when)
+			return 0;
+	} while (!__atomic_compare_exchange_n(t, &old, when, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	return 1;
+}
+
+
+/* Put c on the deadline list at the place of c->deadline. Deadlines are
+ * mostly set in order, so it looks from the end. Returns 1 if c is the
+ * earliest now. Called with __sched_lock held.
+ */
+static int dl_insert(struct __ctx *c)
+{
+	struct __ctx *prev = __dl_tail;
+
+	while (prev && prev->deadline > c->deadline)
+		prev = prev->dl_prev;
+	c->dl_prev = prev;
+	c->dl_next = prev ? prev->dl_next : __dl_head;
+	if (c->dl_next)
+		c->dl_next->dl_prev = c;
+	else
+		__dl_tail = c;
+	if (prev)
+		prev->dl_next = c;
+	else
+		__dl_head = c;
+	return prev == NULL;
+}
+
+
+/* Take c off the deadline list, if it is on it. Called with __sched_lock
+ * held.
+ */
+static void dl_unlink(struct __ctx *c)
+{
+	if (c->deadline == 0)
+		return;
+	if (c->dl_prev)
+		c->dl_prev->dl_next = c->dl_next;
+	else
+		__dl_head = c->dl_next;
+	if (c->dl_next)
+		c->dl_next->dl_prev = c->dl_prev;
+	else
+		__dl_tail = c->dl_prev;
+	c->dl_prev = c->dl_next = NULL;
+	c->deadline = 0;
+}
+
+
+/* Whether the bucket of c's tag holds enough tokens for it. A request larger
+ * than the burst goes once the bucket is full. If not, the watcher is told
+ * when there will be enough, and the tag goes into '*blocked' for the rest
+ * of the scan: requests of a tag go in queue order, so smaller ones can not
+ * keep a large one waiting forever. Called with __sched_lock held.
+ */
+static int rate_admit(const struct __ctx *c, uint64_t *blocked)
+{
+	struct __rate *r = NULL;
+	double need = 0, wait = 0;
+	int64_t now = 0, one = 1;
+	int tag = __fds[c->aio_fildes].rate - 1;
+
+	if (tag < 0)
+		return 1;
+	if (*blocked & ((uint64_t)1 << tag))
+		return 0;
+	r = &__rates[tag];
+
+	now = now_ns();
+	if (r->conf.bytes > 0) {
+		r->bytes += (double)r->conf.bytes*(now - r->stamp)/1000000000;
+		if (r->bytes > r->conf.burst_bytes)
+			r->bytes = r->conf.burst_bytes;
+	}
+	if (r->conf.ops > 0) {
+		r->ops += (double)r->conf.ops*(now - r->stamp)/1000000000;
+		if (r->ops > r->conf.burst_ops)
+			r->ops = r->conf.burst_ops;
+	}
+	r->stamp = now;
+
+	if (r->conf.bytes > 0) {
+		need = c->iocb.aio_nbytes < r->conf.burst_bytes ? c->iocb.aio_nbytes : r->conf.burst_bytes;
+		if (r->bytes < need)
+			wait = (need - r->bytes)/r->conf.bytes;
+	}
+	if (r->conf.ops > 0 && r->ops < 1 && (1 - r->ops)/r->conf.ops > wait)
+		wait = (1 - r->ops)/r->conf.ops;
+	if (wait == 0)
+		return 1;
+	*blocked |= (uint64_t)1 << tag;
+
+	/* the watcher might sleep longer than that */
+	if (sched_timer(&__next_refill, now + (int64_t)(wait*1000000000) + 1))
+		write(__wake_fd, &one, sizeof(one));
+	return 0;
+}
+
+
+/* Take the tokens for c from its bucket, or give them back ('n' = -1) if it
+ * did not make it to the kernel. Called with __sched_lock held.
+ */
+static void rate_charge(const struct __ctx *c, int n)
+{
+	struct __rate *r = NULL;
+
+	if (!__fds[c->aio_fildes].rate || c->iocb.aio_lio_opcode == IOCB_CMD_POLL)
+		return;
+	r = &__rates[__fds[c->aio_fildes].rate - 1];
+	if (r->conf.bytes > 0)
+		r->bytes -= (double)n*c->iocb.aio_nbytes;
+	if (r->conf.ops > 0)
+		r->ops -= n;
+}
+
+
+/* Whether c may go to the kernel now. Nothing goes beyond the process and
+ * the fd limit. Level 0 goes otherwise. The other levels share a budget of
+ * __sched_depth in-flight requests, which shrinks to a quarter while level 0
+ * requests are in flight, so that bulk reads can not pile up in front of
+ * them. AIO_PRIO_IDLE only runs if no level 0 request is in flight at all.
+ * Last, the rate limit of c's tag must allow it. Polls move no data and may
+ * wait for long, so only the process and fd limits apply to them. Called
+ * with __sched_lock held.
+ */
+static int sched_admit(const struct __ctx *c, uint64_t *blocked)
+{
+	int i = 0, low = 0, limit = __sched_depth;
+	const struct __fd_sched *f = &__fds[c->aio_fildes];
+
+	if (__sched_total >= __sched_max || (f->limit && f->inflight >= f->limit))
+		return 0;
+	if (c->iocb.aio_lio_opcode == IOCB_CMD_POLL)
+		return 1;
+	if (c->prio == 0)
+		return rate_admit(c, blocked);
+	for (i = 1; i < PRIO_LEVELS; ++i)
+		low += __sched_inflight[i];
+	if (__sched_inflight[0] > 0) {
+		if (c->prio >= AIO_PRIO_IDLE)
+			return 0;
+		if ((limit /= 4) < 1)
+			limit = 1;
+	}
+	return low < limit && rate_admit(c, blocked);
+}
+
+
+/* In-flight accounting; polls do not count against the levels. Called with
+ * __sched_lock held.
+ */
+static void sched_account(const struct __ctx *c, int n)
+{
+	if (c->iocb.aio_lio_opcode != IOCB_CMD_POLL)
+		__sched_inflight[c->prio] += n;
+	__sched_total += n;
+	__fds[c->aio_fildes].inflight += n;
+}
+
+
+/* Called with __sched_lock held */
+static void sched_enqueue(struct __ctx *c, int head)
+{
+	if (head) {
+		if ((c->sched_next = __sched_head[c->prio]) == NULL)
+			__sched_tail[c->prio] = c;
+		__sched_head[c->prio] = c;
+	} else {
+		c->sched_next = NULL;
+		if (__sched_tail[c->prio])
+			__sched_tail[c->prio]->sched_next = c;
+		else
+			__sched_head[c->prio] = c;
+		__sched_tail[c->prio] = c;
+	}
+	++__sched_queued;
+	++__fds[c->aio_fildes].queued;
+	__atomic_store_n(&c->state, CTX_QUEUED, __ATOMIC_RELAXED);
+}
+
+
+/* Called with __sched_lock held */
+static void sched_unqueue(struct __ctx *c)
+{
+	struct __ctx **p = &__sched_head[c->prio], *prev = NULL;
+
+	for (; *p != NULL; prev = *p, p = &(*p)->sched_next) {
+		if (*p == c) {
+			*p = c->sched_next;
+			if (__sched_tail[c->prio] == c)
+				__sched_tail[c->prio] = prev;
+			c->sched_next = NULL;
+			--__sched_queued;
+			--__fds[c->aio_fildes].queued;
+			break;
+		}
+	}
+}
+
+
+/* Make a failure visible for a request that never made it to the kernel */
+static void ctx_fail(struct __ctx *c, int err)
+{
+	pid_t tid = c->tid;
+
+	get_ctx_list_lock_r(tid);
+	publish(c, -1, err);
+	__atomic_store_n(&c->state, CTX_REAPED, __ATOMIC_RELEASE);
+	put_ctx_list_lock_r(tid);
+}
+
+
+/* c left the kernel */
+static void sched_put(const struct __ctx *c)
+{
+	sched_lock();
+	sched_account(c, -1);
+	sched_unlock();
+}
+
+
+/* Pass the plugged requests of this thread to the kernel in one go. Errors
+ * are made visible per request, like for requests submitted by the watcher.
+ * Must not be called with a list lock held.
+ */
+static void plug_flush(void)
+{
+	struct iocb *iocbps[PLUG_MAX];
+	struct __ctx *c = NULL;
+	int i = 0, k = 0, n = __plug.n, r = 0;
+
+	__plug.n = 0;
+	for (i = 0; i < n; ++i) {
+		iocbps[i] = &__plug.ctxs[i]->iocb;
+		AIO_PROBE_CTX(io_submit, __plug.ctxs[i], 0);
+		TSAN_RELEASE(__plug.ctxs[i]);
+	}
+
+	for (i = 0; i < n;) {
+		if ((r = syscall(__NR_io_submit, __kctx, n - i, iocbps + i)) > 0) {
+			i += r;
+			continue;
+		}
+		r = r < 0 ? -errno : -EAGAIN;
+		c = __plug.ctxs[i];
+
+		/* kernel too old for IOCB_FLAG_IOPRIO */
+		if (r == -EINVAL && (c->iocb.aio_flags & IOCB_FLAG_IOPRIO)) {
+			__ioprio_ok = 0;
+			c->iocb.aio_flags &= ~IOCB_FLAG_IOPRIO;
+			c->iocb.aio_reqprio = 0;
+			continue;
+		}
+
+		sched_lock();
+		if (r == -EAGAIN && __sched_total > n - i) {
+			/* back to the front, in order, until the next completion */
+			for (k = n - 1; k >= i; --k) {
+				sched_account(__plug.ctxs[k], -1);
+				rate_charge(__plug.ctxs[k], -1);
+				sched_enqueue(__plug.ctxs[k], 1);
+			}
+			sched_unlock();
+			return;
+		}
+		sched_account(c, -1);
+		sched_unlock();
+		ctx_fail(c, -r);
+		++i;
+	}
+}
+
+
+static void plug_add(struct __ctx *c)
+{
+	__plug.ctxs[__plug.n++] = c;
+	if (__plug.n == PLUG_MAX)
+		plug_flush();
+}
+
+
+/* Submit queued requests as far as the limits allow, lower levels and older
+ * requests first. Requests held back by their fd's limit do not hold up the
+ * others. If the kernel runs out of resources while something is in flight,
+ * the request is put back until the next completion. If 'own' can not be
+ * submitted, it is left to the caller and its -errno returned. Must not be
+ * called with a list lock held other than the watcher's reader lock.
+ */
+static int sched_kick(struct __ctx *own)
+{
+	struct __ctx *c = NULL;
+	uint64_t blocked = 0;
+	int i = 0, r = 0, ret = 0;
+
+	for (;;) {
+		sched_lock();
+		c = NULL;
+		blocked = 0;
+		if (__sched_total < __sched_max) {
+			for (i = 0; i < PRIO_LEVELS && !c; ++i) {
+				for (c = __sched_head[i]; c != NULL && !sched_admit(c, &blocked); c = c->sched_next)
+					;
+			}
+		}
+		if (!c) {
+			sched_unlock();
+			break;
+		}
+		sched_unqueue(c);
+		sched_account(c, 1);
+		rate_charge(c, 1);
+		__atomic_store_n(&c->state, CTX_INKERNEL, __ATOMIC_RELAXED);
+		sched_unlock();
+
+		if (c == own && __plug.depth > 0) {
+			plug_add(c);
+			continue;
+		}
+		if ((r = ctx_submit(c)) == 0)
+			continue;
+
+		sched_lock();
+		sched_account(c, -1);
+		if (r == -EAGAIN && __sched_total > 0) {
+			rate_charge(c, -1);
+			sched_enqueue(c, 1);
+			sched_unlock();
+			break;
+		}
+		sched_unlock();
+		if (c == own) {
+			__atomic_store_n(&c->state, CTX_NEW, __ATOMIC_RELAXED);
+			ret = r;
+		} else {
+			ctx_fail(c, -r);
+		}
+	}
+	return ret;
+}
+
+
+/* Called with __sched_lock held */
+static void fd_link(struct __ctx *c)
+{
+	struct __fd_sched *f = &__fds[c->aio_fildes];
+
+	c->fd_prev = NULL;
+	if ((c->fd_next = f->reqs) != NULL)
+		f->reqs->fd_prev = c;
+	f->reqs = c;
+	++f->nreqs;
+}
+
+
+/* Called with __sched_lock held. c may not have made it into the index. */
+static void fd_unlink(struct __ctx *c)
+{
+	struct __fd_sched *f = NULL;
+
+	if (c->aio_fildes >= __nfds)
+		return;
+	f = &__fds[c->aio_fildes];
+	if (!c->fd_prev && f->reqs != c)
+		return;
+	if (c->fd_prev)
+		c->fd_prev->fd_next = c->fd_next;
+	else
+		f->reqs = c->fd_next;
+	if (c->fd_next)
+		c->fd_next->fd_prev = c->fd_prev;
+	c->fd_prev = c->fd_next = NULL;
+	--f->nreqs;
+}
+
+
+/* Queue c and submit what the limits allow. Returns 0 or -errno if c
+ * itself failed to go to the kernel.
+ */
+static int sched_submit(struct __ctx *c)
+{
+	int r = 0;
+
+	sched_lock();
+	if ((r = fd_grow(c->aio_fildes)) < 0) {
+		sched_unlock();
+		return r;
+	}
+	fd_link(c);
+	sched_enqueue(c, 0);
+	sched_unlock();
+	return sched_kick(c);
+}
+
+
+/* Take c out of the queue, or out of its chain, if it did not go to the
+ * kernel yet. The steps after it stay with it, they fail along with c.
+ * Returns 1 if so. Called with __sched_lock held.
+ */
+static int sched_take(struct __ctx *c)
+{
+	int state = __atomic_load_n(&c->state, __ATOMIC_RELAXED);
+
+	if (state == CTX_QUEUED) {
+		sched_unqueue(c);
+	} else if (state == CTX_CHAINED) {
+		if (c->chain_prev)
+			__atomic_store_n(&c->chain_prev->chain_next, NULL, __ATOMIC_RELAXED);
+		c->chain_prev = NULL;
+	} else {
+		return 0;
+	}
+	__atomic_store_n(&c->state, CTX_REAPED, __ATOMIC_RELAXED);
+	return 1;
+}
+
+
+static int sched_dequeue(struct __ctx *c)
+{
+	int r = 0;
+
+	sched_lock();
+	r = sched_take(c);
+	sched_unlock();
+	return r;
+}
+
+
+/* Fail the steps of a chain from c on, which never started, with ECANCELED.
+ * Caller holds a reader lock on their list.
+ */
+static void chain_fail(struct __ctx *c)
+{
+	struct __ctx *next = NULL;
+
+	for (; c != NULL; c = next) {
+		sched_lock();
+		if ((next = c->chain_next) != NULL) {
+			__atomic_store_n(&c->chain_next, NULL, __ATOMIC_RELAXED);
+			next->chain_prev = NULL;
+		}
+		sched_take(c);
+		sched_unlock();
+		publish(c, -1, ECANCELED);
+	}
+}
+
+
+/* c, a step of an aio_chain(), finished: queue the next step, or fail the
+ * rest of the chain if c failed. The watcher, which publishes the successes,
+ * submits it along with the other queued requests after its batch. Caller
+ * holds a reader lock on c's list, which is the list of all the steps.
+ */
+static void chain_advance(struct __ctx *c, long int res, int err)
+{
+	struct __ctx *n = NULL;
+	int go = 0;
+
+	sched_lock();
+	if ((n = c->chain_next) != NULL) {
+		__atomic_store_n(&c->chain_next, NULL, __ATOMIC_RELAXED);
+		n->chain_prev = NULL;
+		if (err == 0 && __atomic_load_n(&n->state, __ATOMIC_RELAXED) == CTX_CHAINED) {
+			/* writing what was just read: no more than that */
+			if (n->iocb.aio_lio_opcode == IOCB_CMD_PWRITE &&
+			    c->iocb.aio_lio_opcode == IOCB_CMD_PREAD &&
+			    n->iocb.aio_buf == c->iocb.aio_buf && (uint64_t)res < n->iocb.aio_nbytes)
+				n->iocb.aio_nbytes = res;
+			sched_enqueue(n, 0);
+			go = 1;
+		}
+	}
+	sched_unlock();
+	if (n && !go)
+		chain_fail(n);
+}
+
+
+/* c has been taken off its list. Let go of it in the scheduler and the fd
+ * index, wait until neither the kernel nor aio_cancel() use it anymore and
+ * free it. A timed out request may still be in the kernel, its buffer is in
+ * use until the watcher reaped it.
+ */
+static void ctx_free(struct __ctx *c)
+{
+	struct timespec ms = {0, 1000000};
+
+	sched_lock();
+	sched_take(c);
+	fd_unlink(c);
+	dl_unlink(c);
+	sched_unlock();
+
+	/* Nobody can pin it anymore once it is out of the index. Pairs with
+	 * the release of CTX_REAPED and of the unpinning.
+	 */
+	while (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) == CTX_INKERNEL ||
+	       __atomic_load_n(&c->pins, __ATOMIC_ACQUIRE) > 0)
+		nanosleep(&ms, NULL);
+
+	/* the watcher holds a reader lock while it touches c */
+	get_ctx_list_lock_w(c->tid);
+	put_ctx_list_lock_w(c->tid);
+	free(c);
+}
+
+
+/* Cancel a request pinned by aio_cancel(), unless it was taken out of the
+ * queue already ('queued'). Cancelled requests fail with ECANCELED and
+ * stay around for aio_return(), like finished ones. Sets *kick if a slot
+ * of the kernel context was freed.
+ */
+static int cancel_one(struct __ctx *c, int queued, int *kick)
+{
+	struct io_event result;
+
+	if (queued || sched_dequeue(c)) {
+		ctx_fail(c, ECANCELED);
+		return AIO_CANCELED;
+	}
+	/* Most files can not cancel I/O at all (EINVAL), and newer kernels
+	 * queue the event of a cancelled request (EINPROGRESS), so it is done
+	 * when the watcher says so. Old kernels hand it out right here. A poll
+	 * accepted for cancelling is sure to fail with ECANCELED.
+	 */
+	if (__atomic_load_n(&c->state, __ATOMIC_RELAXED) == CTX_INKERNEL) {
+		if (syscall(__NR_io_cancel, __kctx, &c->iocb, &result) == 0) {
+			sched_put(c);
+			ctx_fail(c, ECANCELED);
+			*kick = 1;
+			return AIO_CANCELED;
+		}
+		if (errno == EINPROGRESS && c->iocb.aio_lio_opcode == IOCB_CMD_POLL)
+			return AIO_CANCELED;
+	}
+	if (__atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE) != EINPROGRESS)
+		return AIO_ALLDONE;
+	return AIO_NOTCANCELED;
+}
+
+
+/* Watcher: fail requests whose deadline passed with ETIMEDOUT, taking them
+ * off the front of the deadline list, and arm the timer for the next one.
+ * Queued requests are just dropped. For requests in the kernel cancellation
+ * is only attempted; they stay in the kernel until the I/O is done (their
+ * buffers are in use until then), and aio_return() waits for it.
+ */
+static void expire_deadlines(void)
+{
+	struct __ctx *c = NULL;
+	struct io_event result;
+	int64_t now = now_ns();
+	pid_t tid = 0;
+	int kick = 0;
+
+	for (;;) {
+		sched_lock();
+		if ((c = __dl_head) == NULL || c->deadline > now) {
+			__atomic_store_n(&__next_deadline, c ? c->deadline : 0, __ATOMIC_SEQ_CST);
+			sched_unlock();
+			break;
+		}
+		/* pinned like by aio_cancel(), so ctx_free() waits for us */
+		dl_unlink(c);
+		__atomic_fetch_add(&c->pins, 1, __ATOMIC_RELAXED);
+		sched_unlock();
+
+		tid = c->tid;
+		get_ctx_list_lock_r(tid);
+		if (!__atomic_load_n(&c->hooked, __ATOMIC_ACQUIRE) &&
+		    __atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE) == EINPROGRESS) {
+			/* Old kernels hand out the event of a cancelled request
+			 * right here instead of queueing it.
+			 */
+			if (!sched_dequeue(c) && __atomic_load_n(&c->state, __ATOMIC_RELAXED) == CTX_INKERNEL &&
+			    syscall(__NR_io_cancel, __kctx, &c->iocb, &result) == 0) {
+				sched_put(c);
+				__atomic_store_n(&c->state, CTX_REAPED, __ATOMIC_RELEASE);
+				kick = 1;
+			}
+			publish(c, -1, ETIMEDOUT);
+		}
+		put_ctx_list_lock_r(tid);
+		__atomic_fetch_sub(&c->pins, 1, __ATOMIC_RELEASE);
+	}
+	if (kick)
+		sched_kick(NULL);
+}
+
+
+static int __watcher_event_fd = -1;
+
+/* Watcher: expire deadlines and let throttled requests in, if due */
+static void run_timers(void)
+{
+	int64_t now = now_ns(), t = 0;
+
+	if ((t = __atomic_load_n(&__next_deadline, __ATOMIC_SEQ_CST)) != 0 && now >= t)
+		expire_deadlines();
+	if ((t = __atomic_load_n(&__next_refill, __ATOMIC_SEQ_CST)) != 0 && now >= t &&
+	    __atomic_compare_exchange_n(&__next_refill, &t, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		sched_kick(NULL);
+}
+
+
+/* Sleep until the kernel signals completions, the next deadline or refill is
+ * due or someone armed an earlier one.
+ */
+static void watcher_wait(int64_t *i64)
+{
+	struct timespec ts, *tsp = NULL;
+	int64_t dl = __atomic_load_n(&__next_deadline, __ATOMIC_SEQ_CST), now = 0, junk = 0;
+	int64_t rf = __atomic_load_n(&__next_refill, __ATOMIC_SEQ_CST);
+	fd_set rset;
+	int n = __watcher_event_fd > __wake_fd ? __watcher_event_fd : __wake_fd;
+
+	if (rf && (!dl || rf < dl))
+		dl = rf;
+	if (dl) {
+		if ((now = now_ns()) >= dl) {
+			run_timers();
+			return;
+		}
+		ts.tv_sec = (dl - now)/1000000000;
+		ts.tv_nsec = (dl - now)%1000000000;
+		tsp = &ts;
+	}
+
+	FD_ZERO(&rset);
+	FD_SET(__watcher_event_fd, &rset);
+	if (__wake_fd >= 0)
+		FD_SET(__wake_fd, &rset);
+	if (pselect(n + 1, &rset, NULL, NULL, tsp, NULL) <= 0)
+		return;
+	if (__wake_fd >= 0 && FD_ISSET(__wake_fd, &rset))
+		read(__wake_fd, &junk, sizeof(junk));
+	if (FD_ISSET(__watcher_event_fd, &rset))
+		read(__watcher_event_fd, i64, sizeof(*i64));
+}
+
+
+/* Watcher: make the result of a finished request visible. Nodes in the
+ * kernel are not freed, aio_return() waits for CTX_REAPED and our lock.
+ */
+static void reap(const struct io_event *ev)
+{
+	struct __ctx *c = (struct __ctx *)(uintptr_t)ev->data;
+	pid_t tid = 0;
+
+	TSAN_ACQUIRE(c);
+	tid = c->tid;
+
+	get_ctx_list_lock_r(tid);
+	sched_put(c);
+	AIO_PROBE_CTX(complete, c, ev->res);
+
+	if (__atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE) != EINPROGRESS) {
+		/* timed out before, the result is gone */
+	} else if (c->hook) {
+		/* published by the worker once the hook ran */
+		c->hook_res = ev->res;
+		__atomic_store_n(&c->hooked, 1, __ATOMIC_RELEASE);
+		queue_work(c);
+	} else if (ev->res == 0 && c->iocb.aio_lio_opcode == IOCB_CMD_POLL) {
+		/* a poll only comes back without events if it was cancelled */
+		publish(c, -1, ECANCELED);
+	} else {
+		publish(c, ev->res, ev->res > 0 ? 0 : -(int)ev->res);
+	}
+	__atomic_store_n(&c->state, CTX_REAPED, __ATOMIC_RELEASE);
+	put_ctx_list_lock_r(tid);
+}
+
+
+static struct io_event __events[EVENTS_BATCH];
+
+static int __aio_watcher(void *vp)
+{
+	struct timespec to = {0, 0};
+	int64_t i64 = 0;
+	int i = 0, n = 0;
+
+	for (;;) {
+		run_timers();
+
+		/* Since we flagged IOCB_FLAG_RESFD, we will receive event on
+		 * eventfd if kernel finds something ready. Anything finishing
+		 * while we fetch events signals it again, so nothing is lost
+		 * by fetching until the context is empty.
+		 */
+		watcher_wait(&i64);
+		do {
+			n = syscall(__NR_io_getevents, __kctx, 0, EVENTS_BATCH, __events, &to);
+			for (i = 0; i < n; ++i)
+				reap(&__events[i]);
+
+			/* the slots are free, let queued requests in */
+			if (n > 0)
+				sched_kick(NULL);
+		} while (n == EVENTS_BATCH);
+	}
+
+	return 0;
+}
+
+
+/* A thread of its own, so its failing syscalls only touch its own errno.
+ * Signals are left to the application's threads.
+ */
+static void *__aio_watcher_pthread(void *vp)
+{
+	sigset_t all;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	__aio_watcher(vp);
+	return NULL;
+}
+
+static void __aio_init()
+{
+	pthread_t t;
+	pthread_attr_t attr;
+	int n = 0, state = AIO_UNINITIALIZED;
+
+	if (!__atomic_compare_exchange_n(&__init_lock, &state, AIO_INITIALIZING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* atomics, but protected by above lock */
+	__ctxs = calloc(TID_MAX + 1, sizeof(struct __ctx *));
+	__ctx_locks = calloc(TID_MAX + 1, sizeof(uint32_t));
+
+	__watcher_event_fd = eventfd(0, 0);
+	__wake_fd = eventfd(0, 0);
+
+	/* Take what the kernel (fs.aio-max-nr) is willing to give */
+	for (n = SCHED_MAX; n > 0; n /= 2) {
+		if (syscall(__NR_io_setup, n, &__kctx) == 0)
+			break;
+	}
+	__kctx_size = __sched_max = n;
+
+	/* goes away with the process */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&t, &attr, __aio_watcher_pthread, NULL);
+	pthread_attr_destroy(&attr);
+
+	/* everything above is seen by whoever sees AIO_INITIALIZED */
+	__atomic_store_n(&__init_lock, AIO_INITIALIZED, __ATOMIC_RELEASE);
+}
+
+
+/* A node for aiocbp, on the list of the calling thread but not submitted
+ * yet. NULL and errno on failure.
+ */
+static struct __ctx *ctx_new(struct aiocb *aiocbp, int opcode, aio_hook_t hook, void *arg, struct __lio *lio)
+{
+	struct __ctx *c = NULL;
+	pid_t tid = 0;
+
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
+		__aio_init();
+
+	errno = 0;
+	if (!aiocbp || aiocbp->aio_reqprio < 0 || !sigev_valid(&aiocbp->aio_sigevent)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (aiocbp->aio_fildes < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (__kctx_size == 0) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	tid = syscall(__NR_gettid);
+
+	if ((c = (struct __ctx *)calloc(1, sizeof(struct __ctx))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Submitted from here, so that io_cancel() finds it. The watcher
+	 * gets c back from the event.
+	 */
+	c->iocb.aio_data = (uintptr_t)c;
+	c->iocb.aio_buf = (size_t)aiocbp->aio_buf;
+	c->iocb.aio_nbytes = aiocbp->aio_nbytes;
+	c->iocb.aio_offset = aiocbp->aio_offset;
+	c->iocb.aio_fildes = aiocbp->aio_fildes;
+	c->iocb.aio_lio_opcode = opcode;
+
+	/* the kernel wants nothing but the fd for these, aio_poll() puts
+	 * the events into aio_buf
+	 */
+	if (opcode == IOCB_CMD_FSYNC || opcode == IOCB_CMD_FDSYNC || opcode == IOCB_CMD_POLL) {
+		c->iocb.aio_buf = 0;
+		c->iocb.aio_nbytes = 0;
+		c->iocb.aio_offset = 0;
+	}
+
+	/* We want notifications by kernel to avoid busy waiting */
+	c->iocb.aio_resfd = __watcher_event_fd;
+	c->iocb.aio_flags |= IOCB_FLAG_RESFD;
+
+	c->prio = aiocbp->aio_reqprio < AIO_PRIO_IDLE ? aiocbp->aio_reqprio : AIO_PRIO_IDLE;
+	if (opcode != IOCB_CMD_POLL)
+		set_ioprio(&c->iocb, c->prio);
+
+	aiocbp->tid = tid;
+	aiocbp->ctx_id = (aio_context_t)(uintptr_t)c;
+	aiocbp->lio_error = 0;
+
+	c->aio_error = aiocbp->aio_error = EINPROGRESS;
+	c->aio_return = aiocbp->aio_return = -1;
+
+	c->aio_fildes = aiocbp->aio_fildes;
+	c->ctx_id = aiocbp->ctx_id;
+	c->aio_sigevent = aiocbp->aio_sigevent;
+	c->tid = tid;
+	c->efd = -1;		/* no event fd yet */
+	c->aiocbp = aiocbp;
+	c->hook = hook;
+	c->hook_arg = arg;
+	c->lio = lio;
+	c->state = CTX_NEW;
+	AIO_PROBE_CTX(submit, c, opcode);
+
+	/* On the list before the kernel sees it, so the watcher finds it */
+	c->next = get_ctx_list_lock_w(tid);
+	__ctxs[ctx_slot(tid)] = c;
+	put_ctx_list_lock_w(tid);
+	return c;
+}
+
 
-/* The node of a context list per thread */
-struct __ctx {
-	aio_context_t ctx_id;
-	int aio_fildes, efd;
-	pid_t tid;
-	struct sigevent aio_sigevent;
-	long int aio_return;
-	int aio_error;
-	struct iocb iocb;
-	struct __ctx *next;
-};
+/* Take c, which never made it to the kernel, off its list and free it */
+static void ctx_drop(struct __ctx *c)
+{
+	struct __ctx **old_c = &__ctxs[ctx_slot(c->tid)];
 
+	for (get_ctx_list_lock_w(c->tid); *old_c != NULL; old_c = &(*old_c)->next) {
+		if (*old_c == c) {
+			*old_c = c->next;
+			break;
+		}
+	}
+	put_ctx_list_lock_w(c->tid);
+	ctx_free(c);
+}
 
-/* atomics, concurrently accessed */
-static int __init_lock = AIO_UNINITIALIZED;
-static struct __ctx **__ctxs = NULL;
-static uint32_t *__ctx_locks = NULL;
 
-/* non-atomics, only accessed reading not not at all */
-static int __watcher_tid = 0;
-static pid_t __likely_tid = 0;
+static int __aio_read_write(struct aiocb *aiocbp, int opcode, aio_hook_t hook, void *arg, struct __lio *lio)
+{
+	struct __ctx *c = NULL;
+	int r = 0;
 
+	if ((c = ctx_new(aiocbp, opcode, hook, arg, lio)) == NULL)
+		return -1;
+	if ((r = sched_submit(c)) == 0)
+		return 0;
+	aiocbp->aio_error = -r;
+	ctx_drop(c);
+	errno = -r;
+	return -1;
+}
 
-static struct __ctx *get_ctx_list_lock_w(pid_t tid)
+
+int aio_read(struct aiocb *aiocbp)
 {
-	/* writers are exclusive i.e. there must be no lock at all */
-	while (__sync_fetch_and_add(__ctx_locks + tid, CTX_LOCKED_W) != CTX_UNLOCKED)
-		__sync_fetch_and_sub(__ctx_locks + tid, CTX_LOCKED_W);
-	return __ctxs[tid];
+	return __aio_read_write(aiocbp, IOCB_CMD_PREAD, NULL, NULL, NULL);
 }
 
 
-static struct __ctx *get_ctx_list_lock_r(pid_t tid)
+int aio_write(struct aiocb *aiocbp)
 {
-	/* any writer lock (i.e. any of the lower 16 bits set)? */
-	while (__sync_fetch_and_add(__ctx_locks + tid, CTX_LOCKED_R) & CTX_WLOCKED_MASK)
-		__sync_fetch_and_sub(__ctx_locks + tid, CTX_LOCKED_R);
-	return __ctxs[tid];
+	return __aio_read_write(aiocbp, IOCB_CMD_PWRITE, NULL, NULL, NULL);
 }
 
 
-static void put_ctx_list_lock_r(pid_t tid)
+int aio_poll(struct aiocb *aiocbp, short events)
 {
-	__sync_fetch_and_sub(__ctx_locks + tid, CTX_LOCKED_R);
+	struct __ctx *c = NULL;
+	int r = 0;
+
+	if ((c = ctx_new(aiocbp, IOCB_CMD_POLL, NULL, NULL, NULL)) == NULL)
+		return -1;
+	c->iocb.aio_buf = (unsigned short)events;
+	if ((r = sched_submit(c)) == 0)
+		return 0;
+	aiocbp->aio_error = -r;
+	ctx_drop(c);
+	errno = -r;
+	return -1;
 }
 
 
-static void put_ctx_list_lock_w(pid_t tid)
+int aio_read_hook(struct aiocb *aiocbp, aio_hook_t hook, void *arg)
 {
-	__sync_fetch_and_sub(__ctx_locks + tid, CTX_LOCKED_W);
+	if (hook && __aio_pool_init() < 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return __aio_read_write(aiocbp, IOCB_CMD_PREAD, hook, arg, NULL);
 }
 
 
-static int notify_finished(struct __ctx *c)
+/* Complete a request whose hook returned AIO_HOOK_DEFER */
+int aio_hook_done(struct aiocb *aiocbp, int err)
 {
-	int64_t one = 1;
+	struct __ctx *c = NULL;
+	int r = -1;
 
-	/* If a event fd is registered in the ctx struct, someone is on
-	 * aio_suspend(), so notify this sleeping thread via event fd.
-	 * Errors dont matter. They may  happen as aio_suspend() only holds a
-	 * reader lock which means that we could write to a c->efd of -1.
-	 * However this is not a fault.
-	 */
-	int fd = __sync_fetch_and_add(&c->efd, 0);
-	if (fd > 0)
-		write(fd, &one, sizeof(one));
+	errno = EINVAL;
+	if (!aiocbp)
+		return -1;
 
-	/* SIGEV_NONE as per standard */
-	if (c->aio_sigevent.sigev_signo != 0 && c->aio_sigevent.sigev_notify != SIGEV_NONE)
-		sigqueue(c->tid, c->aio_sigevent.sigev_signo, c->aio_sigevent.sigev_value);
-	return 0;
+	for (c = get_ctx_list_lock_r(aiocbp->tid); c != NULL; c = c->next) {
+		if (c->ctx_id == aiocbp->ctx_id) {
+			if (__atomic_load_n(&c->hooked, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE) == EINPROGRESS) {
+				hook_finish(c, err);
+				errno = 0;
+				r = 0;
+			}
+			break;
+		}
+	}
+	put_ctx_list_lock_r(aiocbp->tid);
+	return r;
 }
 
 
-static int __watcher_event_fd = -1;
-
-static int __aio_watcher(void *vp)
+int aio_deadline(struct aiocb *aiocbp, const struct timespec *timeout)
 {
-	struct io_event event;
-	struct timespec to;
-	pid_t i = 0;
-	int64_t i64 = 0;
-	int r = 0, done = 0;
 	struct __ctx *c = NULL;
+	int64_t dl = 0, one = 1;
+	int r = -1, wake = 0;
 
-	for (;;) {
-reloop:
-		/* Since we flagged IOCB_FLAG_RESFD, we will receive event on
-		 * eventfd if kernel finds something ready. We also check
-		 * for < 0 since inside the loop we might fetch an event that
-		 * is not signaled when inside the loop and therefore have
-		 * more results than expected.
-		 */
-		if (i64 <= 0) {
-			if (read(__watcher_event_fd, &i64, sizeof(i64)) < 0)
-				continue;
-		}
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
+		__aio_init();
 
-		/* Optimization: in order to not walk thru all TID lists in the common case,
-		 * we start with our parent thread which most likely started the I/O operation.
-		 * We could also start from TID 1, but this will mostly look up empty lists and wastes
-		 * cycles.
-		 */
-		done = 0;
-		for (i = __likely_tid; i != __likely_tid || !done; i = (i+1)%TID_MAX) {
-			done = 1;
-			for (c = get_ctx_list_lock_r(i); c != NULL; c = c->next) {
-				to.tv_sec = 0;
-				to.tv_nsec = 1;
-
-				/* If its not in EINPROGRESS, its already finished */
-				if (__sync_fetch_and_add(&c->aio_error, 0) != EINPROGRESS)
-					continue;
-				r = syscall(__NR_io_getevents, c->ctx_id, 1, 1, &event, &to);
-
-				/* Since we only have a readlock for c, the following assignments need
-				 * to be atomic and in that order!
-				 */
-				if (r > 0) {
-					/* atomic 'c->aio_return = event.res;'
-					 * (must have been inited with -1)
-					 */
-					__sync_val_compare_and_swap(&c->aio_return, -1, event.res);
-					if (event.res > 0) {
-						/* c->aio_error = 0; */
-						__sync_val_compare_and_swap(&c->aio_error, EINPROGRESS, 0);
-					} else {
-						/* c->aio_error = -(int)event.res; */
-						__sync_val_compare_and_swap(&c->aio_error, EINPROGRESS, -(int)event.res);
-					}
-					notify_finished(c);
-				}
-				if (r > 0)
-					--i64;
-				if (i64 <= 0) {
-					put_ctx_list_lock_r(i);
-					goto reloop;
-				}
-			}
-			put_ctx_list_lock_r(i);
+	errno = EINVAL;
+	if (!aiocbp || (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+	                            timeout->tv_nsec >= 1000000000)))
+		return -1;
+	if (timeout)
+		dl = now_ns() + (int64_t)timeout->tv_sec*1000000000 + timeout->tv_nsec;
+
+	for (c = get_ctx_list_lock_r(aiocbp->tid); c != NULL; c = c->next) {
+		if (c->ctx_id == aiocbp->ctx_id) {
+			/* the watcher might sleep longer than that */
+			sched_lock();
+			dl_unlink(c);
+			if ((c->deadline = dl) != 0 && dl_insert(c))
+				wake = sched_timer(&__next_deadline, dl);
+			sched_unlock();
+			errno = 0;
+			r = 0;
+			break;
 		}
 	}
+	put_ctx_list_lock_r(aiocbp->tid);
 
-	return 0;
+	if (wake)
+		write(__wake_fd, &one, sizeof(one));
+	return r;
 }
 
 
-static void __aio_atexit(void)
+int aio_sched_depth(int depth)
 {
-	kill(__watcher_tid, 9);
+	int old = 0;
+
+	sched_lock();
+	old = __sched_depth;
+	if (depth > 0)
+		__sched_depth = depth;
+	sched_unlock();
+	if (depth > old)
+		sched_kick(NULL);
+	return old;
 }
 
-static void __aio_init()
-{
-	if (__sync_val_compare_and_swap(&__init_lock, AIO_UNINITIALIZED, AIO_INITIALIZING) != AIO_UNINITIALIZED)
-		return;
 
-	/* atomics, but protected by above lock */
-	__ctxs = calloc(TID_MAX + 1, sizeof(struct __ctx *));
-	__ctx_locks = calloc(TID_MAX + 1, sizeof(uint32_t));
+int aio_sched_limit(int fd, int max)
+{
+	int old = 0, r = 0;
 
-	__watcher_event_fd = eventfd(0, 0);
-	__likely_tid = syscall(__NR_gettid);
-	__watcher_tid = clone(__aio_watcher, __child_stack + sizeof(__child_stack), CLONE_VM|CLONE_FILES, NULL);
-	if (__watcher_tid > 0)
-		atexit(__aio_atexit);
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
+		__aio_init();
 
-	__sync_val_compare_and_swap(&__init_lock, AIO_INITIALIZING, AIO_INITIALIZED);
+	sched_lock();
+	if (fd < 0) {
+		old = __sched_max;
+		if (max == 0 || max > __kctx_size)
+			max = __kctx_size;
+		if (max > 0)
+			__sched_max = max;
+	} else {
+		if ((r = fd_grow(fd)) < 0) {
+			sched_unlock();
+			errno = -r;
+			return -1;
+		}
+		old = __fds[fd].limit;
+		if (max >= 0)
+			__fds[fd].limit = max;
+	}
+	sched_unlock();
+	sched_kick(NULL);
+	return old;
 }
 
 
-static int __aio_read_write(struct aiocb *aiocbp, int opcode)
+int aio_rate_limit(int tag, const struct aio_rate *rate)
 {
-	int r = 0;
-	struct iocb _iocb[1], *iocbp = _iocb;
-	struct __ctx *c = NULL;
-	pid_t tid = 0;
+	struct __rate *r = NULL;
 
-	while (__sync_fetch_and_add(&__init_lock, 0) != AIO_INITIALIZED)
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
 		__aio_init();
 
-	errno = 0;
-	if (!aiocbp) {
-		errno = EINVAL;
+	errno = EINVAL;
+	if (tag < 0 || tag >= AIO_RATE_TAGS ||
+	    (rate && (rate->bytes < 0 || rate->ops < 0 || rate->burst_bytes < 0 || rate->burst_ops < 0)))
 		return -1;
-	}
-	tid = syscall(__NR_gettid);
 
-	memset(&aiocbp->ctx_id, 0, sizeof(aiocbp->ctx_id));
-	if ((r = syscall(__NR_io_setup, 1, &aiocbp->ctx_id)) < 0) {
-		errno = -r;
-		return -1;
+	/* start with a full bucket */
+	sched_lock();
+	r = &__rates[tag];
+	memset(r, 0, sizeof(*r));
+	if (rate) {
+		r->conf = *rate;
+		if (r->conf.burst_bytes == 0)
+			r->conf.burst_bytes = r->conf.bytes;
+		if (r->conf.burst_ops == 0)
+			r->conf.burst_ops = r->conf.ops;
+		if (r->conf.burst_ops < 1)
+			r->conf.burst_ops = 1;
+		r->bytes = r->conf.burst_bytes;
+		r->ops = r->conf.burst_ops;
+		r->stamp = now_ns();
 	}
+	sched_unlock();
+	sched_kick(NULL);
+	errno = 0;
+	return 0;
+}
 
-	memset(iocbp, 0, sizeof(*iocbp));
-	iocbp->aio_buf = (size_t)aiocbp->aio_buf;
-	iocbp->aio_nbytes = aiocbp->aio_nbytes;
-	iocbp->aio_offset = aiocbp->aio_offset;
-	iocbp->aio_fildes = aiocbp->aio_fildes;
-	iocbp->aio_lio_opcode = opcode;
-	iocbp->aio_reqprio = aiocbp->aio_reqprio;
 
-	/* We want notifications by kernel to avoid busy waiting */
-	iocbp->aio_resfd = __watcher_event_fd;
-	iocbp->aio_flags |= IOCB_FLAG_RESFD;
+int aio_rate_tag(int fd, int tag)
+{
+	int old = 0, r = 0;
 
-	aiocbp->tid = tid;
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
+		__aio_init();
+
+	errno = EINVAL;
+	if (fd < 0 || tag < -1 || tag >= AIO_RATE_TAGS)
+		return -1;
 
-	if ((r = syscall(__NR_io_submit, aiocbp->ctx_id, 1, &iocbp)) < 0) {
+	sched_lock();
+	if ((r = fd_grow(fd)) < 0) {
+		sched_unlock();
 		errno = -r;
 		return -1;
 	}
+	old = __fds[fd].rate - 1;
+	__fds[fd].rate = tag + 1;
+	sched_unlock();
+	sched_kick(NULL);
+	errno = 0;
+	return old;
+}
 
-	c = (struct __ctx *)calloc(1, sizeof(struct __ctx));
-	memcpy(&c->iocb, iocbp, sizeof(*iocbp));
-
-	c->aio_error = aiocbp->aio_error = EINPROGRESS;
-	c->aio_return = aiocbp->aio_return = -1;
 
-	c->aio_fildes = aiocbp->aio_fildes;
-	c->ctx_id = aiocbp->ctx_id;
-	c->aio_sigevent = aiocbp->aio_sigevent;
-	c->tid = tid;
-	c->efd = -1;		/* no event fd yet */
-	__sync_synchronize();
+int aio_sched_stats(int fd, struct aio_sched_stats *st)
+{
+	errno = EINVAL;
+	if (!st)
+		return -1;
 
-	c->next = get_ctx_list_lock_w(tid);
-	__ctxs[tid] = c;
-	put_ctx_list_lock_w(tid);
+	sched_lock();
+	if (fd < 0) {
+		st->inflight = __sched_total;
+		st->queued = __sched_queued;
+	} else if (fd < __nfds) {
+		st->inflight = __fds[fd].inflight;
+		st->queued = __fds[fd].queued;
+	} else {
+		st->inflight = st->queued = 0;
+	}
+	sched_unlock();
+	errno = 0;
 	return 0;
 }
 
 
-int aio_read(struct aiocb *aiocbp)
+void aio_plug(void)
 {
-	return __aio_read_write(aiocbp, IOCB_CMD_PREAD);
+	++__plug.depth;
 }
 
 
-int aio_write(struct aiocb *aiocbp)
+void aio_unplug(void)
 {
-	return __aio_read_write(aiocbp, IOCB_CMD_PWRITE);
+	if (__plug.depth > 0 && --__plug.depth == 0 && __plug.n > 0)
+		plug_flush();
 }
 
 
@@ -336,11 +1810,17 @@ int aio_fsync(int op, struct aiocb *aiocbp)
 {
 	int r = 0;
 
+	/* fsync() has to see the plugged writes */
+	if (__plug.n > 0)
+		plug_flush();
+
 	errno = 0;
 	if (!aiocbp) {
 		errno = EINVAL;
 		return -1;
 	}
+	AIO_PROBE5(submit, aiocbp, aiocbp->aio_fildes, 0LL, 0LL,
+	           (long long)(op == O_SYNC ? IOCB_CMD_FSYNC : IOCB_CMD_FDSYNC));
 	switch (op) {
 	case O_SYNC:
 		r = fsync(aiocbp->aio_fildes);
@@ -354,8 +1834,12 @@ int aio_fsync(int op, struct aiocb *aiocbp)
 #endif
 	default:
 		errno = EINVAL;
-
+		r = -1;
 	}
+
+	/* Done right here: the result is visible and handed back at once */
+	AIO_PROBE5(notify, aiocbp, aiocbp->aio_fildes, 0LL, 0LL, (long long)(r < 0 ? -errno : 0));
+	AIO_PROBE5(return, aiocbp, aiocbp->aio_fildes, 0LL, 0LL, (long long)(r < 0 ? -errno : 0));
 	return r;
 }
 
@@ -365,9 +1849,13 @@ int aio_error(struct aiocb *aiocbp)
 	int r = -1;
 	struct __ctx *c = NULL;
 
-	while (__sync_fetch_and_add(&__init_lock, 0) != AIO_INITIALIZED)
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
 		__aio_init();
 
+	/* plugged requests would never finish */
+	if (__plug.n > 0)
+		plug_flush();
+
 	errno = EINVAL;
 	if (!aiocbp) {
 		return -1;
@@ -384,7 +1872,12 @@ int aio_error(struct aiocb *aiocbp)
 	for (; c != NULL;) {
 		if (c->ctx_id == aiocbp->ctx_id) {
 			errno = 0;
-			r = aiocbp->aio_error = __sync_fetch_and_add(&c->aio_error, 0);
+			/* the watcher may be publishing right now, so do not
+			 * write EINPROGRESS back over its result
+			 */
+			r = __atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE);
+			if (r != EINPROGRESS)
+				__atomic_store_n(&aiocbp->aio_error, r, __ATOMIC_RELAXED);
 			break;
 		}
 		c = c->next;
@@ -396,85 +1889,74 @@ int aio_error(struct aiocb *aiocbp)
 
 int aio_cancel(int fd, struct aiocb *aiocbp)
 {
-	struct io_event result;
-	struct __ctx *c = NULL, **old_c = NULL, *c2 = NULL;
-	int r = AIO_NOTCANCELED, sr = 0, is_valid_fd = 0;
-	pid_t tid = 0;
+	struct __ctx *c = NULL, *one[1], **cs = one;
+	char queued[1], *qs = queued;
+	int r = AIO_CANCELED, cr = 0, i = 0, n = 0, kick = 0;
 
-	while (__sync_fetch_and_add(&__init_lock, 0) != AIO_INITIALIZED)
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
 		__aio_init();
 
+	if (__plug.n > 0)
+		plug_flush();
+
 	errno = 0;
+	if (aiocbp)
+		fd = aiocbp->aio_fildes;
 
-	/* special case: cancel all operations for this fd (in this thread) */
-	if (!aiocbp) {
-		tid = syscall(__NR_gettid);
-		c = get_ctx_list_lock_w(tid);
-		if (!c) {
-			put_ctx_list_lock_w(tid);
-			errno = EBADF;
+	/* Pin the requests of this fd, of all threads, so they stay around
+	 * while we work on them. Queued ones, and chain steps which did not
+	 * start yet, are taken out right away.
+	 */
+	sched_lock();
+	if (fd >= 0 && fd < __nfds && (n = __fds[fd].nreqs) > 0 && !aiocbp) {
+		if ((cs = malloc(n*sizeof(*cs))) == NULL || (qs = malloc(n)) == NULL) {
+			sched_unlock();
+			free(cs);
+			errno = ENOMEM;
 			return -1;
 		}
-		old_c = &__ctxs[tid];
-		r = AIO_CANCELED;
-		for (; c != NULL;) {
-			if (c->aio_fildes == fd) {
-				is_valid_fd = 1;
-				if ((sr = syscall(__NR_io_cancel, c->ctx_id, &c->iocb, &result)) < 0) {
-					/* Also see below EINVAL check. And dont flip from AIO_NOTCANCELED back
-					 * to AIO_ALLDONE
-					 */
-					if (errno == EINVAL && r != AIO_NOTCANCELED)
-						r = AIO_ALLDONE;
-					else
-						r = AIO_NOTCANCELED;
-					old_c = &c->next;
-					c = c->next;
-				} else {
-					syscall(__NR_io_destroy, c->ctx_id);
-					c2 = c;
-					*old_c = c->next;
-					c = c->next;
-					free(c2);
-				}
-			} else {
-				old_c = &c->next;
-				c = c->next;
-			}
-		}
-		__sync_synchronize();
+	}
+	for (i = 0, c = n ? __fds[fd].reqs : NULL; c != NULL; c = c->fd_next) {
+		if (aiocbp && c->ctx_id != aiocbp->ctx_id)
+			continue;
+		qs[i] = sched_take(c);
+		__atomic_fetch_add(&c->pins, 1, __ATOMIC_RELAXED);
+		cs[i++] = c;
+		if (aiocbp)
+			break;
+	}
+	sched_unlock();
+	n = i;
 
-		/* Found this fd at all? */
-		if (!is_valid_fd) {
-			r = -1;
+	if (n == 0) {
+		/* not ours (anymore), or nothing submitted for a valid fd */
+		if (!aiocbp && fcntl(fd, F_GETFD) < 0) {
 			errno = EBADF;
+			return -1;
 		}
-	} else {
-		tid = aiocbp->tid;
-		c = get_ctx_list_lock_w(tid);
-		old_c = &__ctxs[tid];
-		for (; c != NULL; c = c->next) {
-			if (c->ctx_id == aiocbp->ctx_id) {
-				if ((sr = syscall(__NR_io_cancel, c->ctx_id, &c->iocb, &result)) < 0) {
-					/* syscall does not tell by return whether a ctx has already been finished
-					 * so we argue that since we control all ctx_id's the only cause for an EINVAL
-					 * could be that this ctx_id already succeeded and is therefor invalid
-					 */
-					if (errno == EINVAL)
-						r = AIO_ALLDONE;
-				} else {
-					syscall(__NR_io_destroy, c->ctx_id);
-					*old_c = c->next;
-					free(c);
-					r = AIO_CANCELED;
-				}
-				__sync_synchronize();
-				break;
-			}
-			old_c = &c->next;
-		}
+		return AIO_ALLDONE;
 	}
-	put_ctx_list_lock_w(tid);
+
+	/* The queued ones first, then the io_cancel()s back to back. Dont flip
+	 * from AIO_NOTCANCELED back to AIO_ALLDONE.
+	 */
+	for (i = 0; i < n; ++i) {
+		if (qs[i])
+			cancel_one(cs[i], 1, &kick);
+	}
+	for (i = 0; i < n; ++i) {
+		if (!qs[i] && (cr = cancel_one(cs[i], 0, &kick)) != AIO_CANCELED && r != AIO_NOTCANCELED)
+			r = cr;
+	}
+	for (i = 0; i < n; ++i)
+		__atomic_fetch_sub(&cs[i]->pins, 1, __ATOMIC_RELEASE);
+
+	if (cs != one) {
+		free(cs);
+		free(qs);
+	}
+	if (kick)
+		sched_kick(NULL);
 	return r;
 }
 
@@ -487,9 +1969,12 @@ static int do_aio_suspend(const struct aiocb *const cblist[], int n, const struc
 	struct __ctx *c = NULL;
 	fd_set rset;
 
-	while (__sync_fetch_and_add(&__init_lock, 0) != AIO_INITIALIZED)
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
 		__aio_init();
 
+	if (__plug.n > 0)
+		plug_flush();
+
 	errno = 0;
 
 	/* For each of the aiocb's, set the event fd where the watcher thread
@@ -512,7 +1997,7 @@ static int do_aio_suspend(const struct aiocb *const cblist[], int n, const struc
 		for (c = get_ctx_list_lock_w(aiocbp->tid); c != NULL; c = c->next) {
 			if (c->ctx_id == aiocbp->ctx_id) {
 				/* If already finished, nothing to do */
-				if (__sync_fetch_and_add(&c->aio_error, 0) != EINPROGRESS) {
+				if (__atomic_load_n(&c->aio_error, __ATOMIC_ACQUIRE) != EINPROGRESS) {
 					ready = 1;
 					break;
 				}
@@ -527,7 +2012,7 @@ static int do_aio_suspend(const struct aiocb *const cblist[], int n, const struc
 					}
 				}
 				/* atomic c->efd = evfd; */
-				__sync_lock_test_and_set(&c->efd, evfd);
+				__atomic_store_n(&c->efd, evfd, __ATOMIC_RELAXED);
 				++hits;
 				break;
 			}
@@ -552,14 +2037,17 @@ static int do_aio_suspend(const struct aiocb *const cblist[], int n, const struc
 		aiocbp = cblist[i];
 		if (!aiocbp)
 			continue;
-		/* Use reader-lock now but set efd atomic (see above comment).*/
-		for (c = get_ctx_list_lock_r(aiocbp->tid); c != NULL; c = c->next) {
+		/* A writer lock again: whoever publishes c holds a reader
+		 * lock, so once we have it nobody writes to evfd anymore
+		 * and it can be closed without hitting a reused fd.
+		 */
+		for (c = get_ctx_list_lock_w(aiocbp->tid); c != NULL; c = c->next) {
 			if (c->ctx_id == aiocbp->ctx_id) {
-				__sync_lock_test_and_set(&c->efd, -1);
+				__atomic_store_n(&c->efd, -1, __ATOMIC_RELAXED);
 				break;
 			}
 		}
-		put_ctx_list_lock_r(aiocbp->tid);
+		put_ctx_list_lock_w(aiocbp->tid);
 	}
 
 	if (ready) {
@@ -585,7 +2073,12 @@ static int do_aio_suspend(const struct aiocb *const cblist[], int n, const struc
 
 int aio_suspend(const struct aiocb *const cblist[], int n, const struct timespec *timeout)
 {
-	return do_aio_suspend(cblist, n, timeout);
+	int r = 0;
+
+	AIO_PROBE3(suspend_enter, cblist, n, cblist && n > 0 ? cblist[0] : NULL);
+	r = do_aio_suspend(cblist, n, timeout);
+	AIO_PROBE3(suspend_exit, cblist, n, r < 0 ? -errno : 0);
+	return r;
 }
 
 
@@ -595,9 +2088,12 @@ long int aio_return(struct aiocb *aiocbp)
 	struct __ctx *c = NULL, **old_c = NULL;
 	long int r = 0;
 
-	while (__sync_fetch_and_add(&__init_lock, 0) != AIO_INITIALIZED)
+	while (__atomic_load_n(&__init_lock, __ATOMIC_ACQUIRE) != AIO_INITIALIZED)
 		__aio_init();
 
+	if (__plug.n > 0)
+		plug_flush();
+
 	errno = EINVAL;
 	if (!aiocbp) {
 		return -1;
@@ -605,24 +2101,96 @@ long int aio_return(struct aiocb *aiocbp)
 
 	/* We are going to modify the list, so we need a writer lock. */
 	c = get_ctx_list_lock_w(aiocbp->tid);
-	old_c = &__ctxs[aiocbp->tid];
+	old_c = &__ctxs[ctx_slot(aiocbp->tid)];
 	for (; c != NULL; c = c->next) {
 		if (c->ctx_id == aiocbp->ctx_id) {
+			/* a chain step which did not start yet stays */
+			if (__atomic_load_n(&c->state, __ATOMIC_RELAXED) == CTX_CHAINED) {
+				r = -1;
+				c = NULL;
+				break;
+			}
 			errno = 0;
 			*old_c = c->next;
-			r = __sync_fetch_and_add(&c->aio_return, 0);
-			syscall(__NR_io_destroy, c->ctx_id);
-			free(c);
-			__sync_synchronize();
+			/* ordered by the list lock, like aio_error */
+			r = __atomic_load_n(&c->aio_return, __ATOMIC_RELAXED);
+			AIO_PROBE_CTX(return, c, r);
 			break;
 		}
 		old_c = &c->next;
 	}
 	put_ctx_list_lock_w(aiocbp->tid);
+
+	if (c)
+		ctx_free(c);
 	return r;
 }
 
 
+/* A list of 'n' members for lio_listio() or aio_chain(), plus one count for
+ * the caller, so it can not finish while the members are submitted. The sig
+ * is for the whole list and only used for LIO_NOWAIT.
+ */
+static struct __lio *lio_new(int mode, int n, const struct sigevent *sig)
+{
+	struct __lio *l = NULL;
+
+	if (sig && mode == LIO_NOWAIT && !sigev_valid(sig)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((l = calloc(1, sizeof(*l))) == NULL) {
+		errno = EAGAIN;
+		return NULL;
+	}
+	l->pending = n + 1;
+	l->mode = mode;
+	l->efd = -1;
+	l->tid = syscall(__NR_gettid);
+	if (sig && mode == LIO_NOWAIT)
+		l->sig = *sig;
+	if (mode == LIO_WAIT && (l->efd = eventfd(0, 0)) < 0) {
+		free(l);
+		errno = EAGAIN;
+		return NULL;
+	}
+	return l;
+}
+
+
+/* All members of l are submitted. For LIO_WAIT, sleep until the last one
+ * finished; one wakeup for the whole list. Returns -1 and EIO if any of
+ * the 'nent' members of 'list' failed.
+ */
+static int lio_finish(struct __lio *l, struct aiocb *const list[], int nent)
+{
+	int64_t i64 = 0;
+	int i = 0;
+
+	if (l->mode == LIO_NOWAIT) {
+		lio_put(l);
+		return 0;
+	}
+
+	if (__atomic_sub_fetch(&l->pending, 1, __ATOMIC_ACQ_REL) != 0) {
+		while (read(l->efd, &i64, sizeof(i64)) < 0 && errno == EINTR)
+			;
+	}
+	close(l->efd);
+	free(l);
+
+	for (i = 0; i < nent; ++i) {
+		if (list[i] && list[i]->aio_lio_opcode != LIO_NOP && aio_error(list[i]) != 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+	errno = 0;
+	return 0;
+}
+
+
 /* without -std=c99, GCC has the "restrict" keyoword not available */
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
 int lio_listio(int mode, struct aiocb *restrict const list[restrict], int nent, struct sigevent *sig)
@@ -630,7 +2198,8 @@ int lio_listio(int mode, struct aiocb *restrict const list[restrict], int nent,
 int lio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent *sig)
 #endif
 {
-	int i = 0, r = 0, aio_listio_max = -1, aio_max = -1;
+	int i = 0, r = 0, err = 0, aio_listio_max = -1, aio_max = -1;
+	struct __lio *l = NULL;
 	errno = 0;
 
 	/* if glibc doesnt properly define them */
@@ -650,39 +2219,120 @@ int lio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent *
 		return -1;
 	}
 
-	/* Set lio_error rather than aio_error! */
-	for (i = 0; i < nent; ++i) {
-		if (sig)
-			list[i]->aio_sigevent = *sig;
-		if (list[i]->aio_lio_opcode == LIO_READ) {
-			if ((r = __aio_read_write(list[i], IOCB_CMD_PREAD)) < 0) {
+	if ((l = lio_new(mode, nent, sig)) == NULL)
+		return -1;
+
+	/* Set lio_error rather than aio_error! The list goes to the kernel
+	 * in batches.
+	 */
+	aio_plug();
+	for (i = 0; i < nent && !err; ++i) {
+		if (!list[i] || list[i]->aio_lio_opcode == LIO_NOP) {
+			lio_put(l);
+		} else if (list[i]->aio_lio_opcode == LIO_READ) {
+			if ((r = __aio_read_write(list[i], IOCB_CMD_PREAD, NULL, NULL, l)) < 0) {
 				list[i]->lio_error = r;
-				errno = EAGAIN;
-				return -1;
+				err = EAGAIN;
 			}
 		} else if (list[i]->aio_lio_opcode == LIO_WRITE) {
-			if ((r = __aio_read_write(list[i], IOCB_CMD_PWRITE)) < 0) {
+			if ((r = __aio_read_write(list[i], IOCB_CMD_PWRITE, NULL, NULL, l)) < 0) {
 				list[i]->lio_error = r;
-				errno = EAGAIN;
-				return -1;
+				err = EAGAIN;
 			}
-		} else if (list[i]->aio_lio_opcode != LIO_NOP) {
+		} else {
 			list[i]->lio_error = EIO;
-			errno = EIO;
-			return -1;
+			err = EIO;
 		}
 	}
-	if (mode == LIO_NOWAIT)
-		return 0;
+	aio_unplug();
+
+	/* The rest never started, and nobody waits for the ones that did */
+	if (err) {
+		if (l->efd >= 0)
+			close(l->efd);
+		l->mode = LIO_NOWAIT;
+		l->sig.sigev_notify = SIGEV_NONE;
+		__atomic_fetch_sub(&l->pending, nent - i + 1, __ATOMIC_ACQ_REL);
+		lio_put(l);
+		errno = err;
+		return -1;
+	}
+	return lio_finish(l, (struct aiocb *const *)list, nent);
+}
+
+
+int aio_chain(int mode, struct aiocb *const list[], int nent, struct sigevent *sig)
+{
+	struct __ctx *c = NULL, *first = NULL, *prev = NULL;
+	struct __lio *l = NULL;
+	int i = 0, r = 0, err = 0, opcode = 0;
 
-	r = 0;
+	errno = EINVAL;
+	if (nent <= 0 || (mode != LIO_WAIT && mode != LIO_NOWAIT))
+		return -1;
 	for (i = 0; i < nent; ++i) {
-		if (list[i]) {
-			r -= do_aio_suspend((const struct aiocb *const *)&list[i], 1, NULL);
+		if (!list[i] || list[i]->aio_lio_opcode < LIO_READ ||
+		    list[i]->aio_lio_opcode > LIO_FDSYNC || list[i]->aio_lio_opcode == LIO_NOP)
+			return -1;
+	}
+
+	if ((l = lio_new(mode, nent, sig)) == NULL)
+		return -1;
+
+	/* All steps are set up before the first one goes, so the completion
+	 * path neither allocates nor fails for lack of memory.
+	 */
+	for (i = 0; i < nent && !err; ++i) {
+		switch (list[i]->aio_lio_opcode) {
+		case LIO_READ:
+			opcode = IOCB_CMD_PREAD;
+			break;
+		case LIO_WRITE:
+			opcode = IOCB_CMD_PWRITE;
+			break;
+		case LIO_FSYNC:
+			opcode = IOCB_CMD_FSYNC;
+			break;
+		default:
+			opcode = IOCB_CMD_FDSYNC;
 		}
+		if ((c = ctx_new(list[i], opcode, NULL, NULL, l)) == NULL) {
+			err = errno;
+			break;
+		}
+		/* linked in any case, so a failure takes back all steps */
+		sched_lock();
+		if (prev) {
+			__atomic_store_n(&c->state, CTX_CHAINED, __ATOMIC_RELAXED);
+			__atomic_store_n(&prev->chain_next, c, __ATOMIC_RELAXED);
+			c->chain_prev = prev;
+		}
+		if ((r = fd_grow(c->aio_fildes)) < 0)
+			err = -r;
+		else if (prev)
+			fd_link(c);
+		sched_unlock();
+		if (!first)
+			first = c;
+		prev = c;
 	}
-	if (r < 0)
+
+	if (!err && (r = sched_submit(first)) < 0)
+		err = -r;
+
+	/* Nothing started: take the steps back, from the end */
+	if (err) {
+		for (c = prev; c != NULL; c = prev) {
+			prev = c->chain_prev;
+			c->aiocbp->aio_error = err;
+			ctx_drop(c);
+		}
+		if (l->efd >= 0)
+			close(l->efd);
+		free(l);
+		errno = err;
 		return -1;
-	return 0;
+	}
+	return lio_finish(l, list, nent);
 }
 
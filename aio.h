@@ -36,7 +36,7 @@ typedef int64_t __s64;
 
 
 #ifndef ANDROID
-#ifndef __timespec_defined
+#if !defined(__timespec_defined) && !defined(_STRUCT_TIMESPEC)
 #define __timespec_defined 1
 
 struct timespec {
@@ -47,6 +47,36 @@ struct timespec {
 #endif
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef AIO_GLIBC_LAYOUT
+
+/* The layout of glibc's struct aiocb, for libaio-posix.so to be used by
+ * programs built against glibc's <aio.h>. Our members take the place of
+ * glibc's internal ones.
+ */
+struct aiocb
+{
+	int aio_fildes;
+	int aio_lio_opcode;
+	int aio_reqprio;
+	void *aio_buf;
+	size_t aio_nbytes;
+	struct sigevent aio_sigevent;
+
+	aio_context_t ctx_id;		/* __next_prio */
+	pid_t tid;			/* __abs_prio */
+	int lio_error;			/* __policy */
+	int aio_error;			/* __error_code */
+	long int aio_return;		/* __return_value */
+	size_t aio_offset;
+	char __glibc_reserved[32];
+};
+
+#else
+
 struct aiocb
 {
 	int aio_fildes;
@@ -63,6 +93,8 @@ struct aiocb
 	pid_t tid;
 };
 
+#endif
+
 
 enum {
 	AIO_CANCELED,
@@ -83,6 +115,11 @@ enum {
 };
 
 
+/* aio_sigevent, and the sigevent of a LIO_NOWAIT lio_listio(), may be
+ * SIGEV_NONE, SIGEV_SIGNAL (sigev_signo 0 sends nothing) or SIGEV_THREAD.
+ * sigev_notify_function is run on a new thread, detached unless given
+ * sigev_notify_attributes. Anything else fails with EINVAL.
+ */
 int aio_read(struct aiocb *aiocbp);
 
 int aio_write(struct aiocb *aiocbp);
@@ -103,6 +140,139 @@ int lio_listio(int mode, struct aiocb *restrict const list[restrict], int nent,
 int lio_listio(int mode, struct aiocb *const list[], int nent, struct sigevent * sig);
 #endif
 
+
+/* Non-POSIX extensions */
+
+/* aio_error() without calling into the library: the result is stored into
+ * the aiocb when the request finishes, so this is a single load. Cheap enough
+ * to poll many aiocbs in a loop. Once it is not EINPROGRESS, aio_return is
+ * valid as well, but aio_return() still has to be called to release it.
+ * Unlike aio_error() it never flushes an aio_plug(), so spinning on a request
+ * still held back by the calling thread's plug never ends.
+ */
+static inline int aio_error_fast(const struct aiocb *aiocbp)
+{
+	return __atomic_load_n(&aiocbp->aio_error, __ATOMIC_ACQUIRE);
+}
+
+/* Wait for the fd of aiocbp to become ready for 'events' (POLLIN, POLLOUT
+ * and so on, see poll(2)), e.g. on a pipe or socket. Completes like a read:
+ * thru aio_error(), aio_suspend() and aio_sigevent, and aio_return() is
+ * the revents mask. aio_buf, aio_nbytes and aio_offset are not used. It is
+ * one-shot; aio_deadline() gives it a timeout and aio_cancel() always
+ * cancels it. Needs kernel 4.18+, EINVAL otherwise.
+ */
+int aio_poll(struct aiocb *aiocbp, short events);
+
+enum {
+	/* hook keeps the request and completes it later via aio_hook_done() */
+	AIO_HOOK_DEFER	= -1
+};
+
+/* Runs on a worker thread once a read submitted by aio_read_hook() has
+ * finished, before the completion becomes visible via aio_error() and
+ * friends. 'res' is what aio_return() is going to return. Returns 0, an
+ * errno value to fail the request, or AIO_HOOK_DEFER.
+ */
+typedef int (*aio_hook_t)(struct aiocb *aiocbp, long int res, void *arg);
+
+int aio_read_hook(struct aiocb *aiocbp, aio_hook_t hook, void *arg);
+
+int aio_hook_done(struct aiocb *aiocbp, int err);
+
+
+enum {
+	/* aio_reqprio from which on a request only runs while no aio_reqprio 0
+	 * request is in flight; larger values are the same
+	 */
+	AIO_PRIO_IDLE	= 8
+};
+
+/* Fail a submitted request with ETIMEDOUT unless it finished within
+ * 'timeout' from now; NULL disarms it. If the kernel already owns the I/O,
+ * aio_return() waits for it to let go of the buffer.
+ */
+int aio_deadline(struct aiocb *aiocbp, const struct timespec *timeout);
+
+/* Set how many requests with aio_reqprio > 0 may be in flight at once (a
+ * quarter of it while aio_reqprio 0 requests are). The rest is queued.
+ * Returns the previous value; pass 0 to query.
+ */
+int aio_sched_depth(int depth);
+
+/* Limit the number of requests in flight for 'fd', or for the process if
+ * 'fd' is -1. Requests beyond are queued and submitted as others finish.
+ * For an fd, 0 means no limit. The process limit can not go beyond what the
+ * kernel gave us (fs.aio-max-nr), which is also what 0 means. Returns the
+ * previous value; pass a negative 'max' to query.
+ */
+int aio_sched_limit(int fd, int max);
+
+struct aio_sched_stats {
+	int inflight;		/* submitted to the kernel */
+	int queued;		/* waiting for a limit */
+};
+
+/* Current depths for 'fd', or for the process if 'fd' is -1 */
+int aio_sched_stats(int fd, struct aio_sched_stats *st);
+
+enum {
+	/* number of aio_rate_limit() buckets */
+	AIO_RATE_TAGS	= 64
+};
+
+struct aio_rate {
+	long long bytes;	/* per second, 0 for no limit */
+	long long ops;		/* requests per second, 0 for no limit */
+	long long burst_bytes;	/* bucket sizes, 0 for one second's worth */
+	long long burst_ops;
+};
+
+/* Cap the requests on the fds tagged 'tag' (0 .. AIO_RATE_TAGS-1) by token
+ * buckets. Requests beyond the rate are queued and submitted by the watcher
+ * as the buckets refill; the caller is never put to sleep. A request larger
+ * than the burst goes once the bucket is full. NULL lifts the limit.
+ */
+int aio_rate_limit(int tag, const struct aio_rate *rate);
+
+/* Tag the requests on 'fd' with 'tag' from now on, several fds may share
+ * one. -1 removes the tag. Returns the previous tag.
+ */
+int aio_rate_tag(int fd, int tag);
+
+/* Between aio_plug() and aio_unplug(), aio_read() and aio_write() of the
+ * calling thread only collect their requests, which then go to the kernel
+ * in one io_submit(). They are flushed early every 32 requests and before
+ * the thread waits for or asks about a request (aio_suspend(), aio_error(),
+ * aio_return(), aio_cancel(), aio_fsync(), but not aio_error_fast()).
+ * Submission errors show up per request via aio_error(). Plugs nest.
+ */
+void aio_plug(void);
+
+void aio_unplug(void);
+
+enum {
+	/* aio_lio_opcode of aio_chain() steps, besides LIO_READ and LIO_WRITE */
+	LIO_FSYNC	= LIO_NOP + 1,
+	LIO_FDSYNC
+};
+
+/* Run the 'nent' requests of 'list' one after the other: each one is
+ * submitted by the library once the one before finished, without a round
+ * trip thru the caller. A write right after a read of the same buffer
+ * writes no more than was read. If a step fails, the rest fail with
+ * ECANCELED. 'mode' and 'sig' are those of lio_listio(): LIO_WAIT returns
+ * when the chain is done (-1 and EIO if a step failed), LIO_NOWAIT sends
+ * 'sig' once, when the last step finished. Every step still needs its
+ * aio_return(), which fails with EINVAL while a step did not start. Sync
+ * steps need kernel 4.18+.
+ */
+int aio_chain(int mode, struct aiocb *const list[], int nent, struct sigevent *sig);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 
@@ -0,0 +1,583 @@
+/* C++20 layer on top of aio.h: aiocbs owned by move-only objects, reads
+ * and writes that coroutines can co_await, and an executor which resumes
+ * them as their requests finish. One thread drives any number of waiting
+ * coroutines; the awaited operation lives in the coroutine frame, so there
+ * is no allocation per request. Header only, link with aio.o as usual.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_hpp__
+#define __aio_hpp__
+
+#if __cplusplus < 202002L
+#error "aio.hpp needs C++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+#include "aio.h"
+
+namespace aio {
+
+
+/* An aiocb and the request submitted thru it. The library stores the result
+ * into the aiocb in place, so it may only be moved while idle (moving a
+ * request in flight terminates). Destroying one in flight cancels it and
+ * waits until the kernel let go of the buffer.
+ */
+class request {
+public:
+	request() noexcept
+	{
+		std::memset(&cb_, 0, sizeof(cb_));
+	}
+
+	request(const request &) = delete;
+	request &operator=(const request &) = delete;
+
+	request(request &&o) noexcept : request()
+	{
+		if (o.busy_)
+			std::terminate();
+		cb_ = o.cb_;
+	}
+
+	request &operator=(request &&o) noexcept
+	{
+		if (o.busy_)
+			std::terminate();
+		reset();
+		cb_ = o.cb_;
+		return *this;
+	}
+
+	~request()
+	{
+		reset();
+	}
+
+	/* Submit; 0 or -1 and errno as aio_read()/aio_write() */
+	int read(int fd, void *buf, size_t n, off_t off, int prio = 0)
+	{
+		return submit(LIO_READ, fd, buf, n, off, prio);
+	}
+
+	int write(int fd, const void *buf, size_t n, off_t off, int prio = 0)
+	{
+		return submit(LIO_WRITE, fd, const_cast<void *>(buf), n, off, prio);
+	}
+
+	bool busy() const noexcept
+	{
+		return busy_;
+	}
+
+	/* Finished, without calling into the library */
+	bool done() const noexcept
+	{
+		return busy_ && aio_error_fast(&cb_) != EINPROGRESS;
+	}
+
+	/* Reap a finished request: the bytes transferred or -errno */
+	long result() noexcept
+	{
+		int e = aio_error(&cb_);
+		long r = aio_return(&cb_);
+
+		busy_ = false;
+		return e ? -e : r;
+	}
+
+	/* Block until finished, then result() */
+	long wait() noexcept
+	{
+		const struct aiocb *cbl[1] = {&cb_};
+
+		if (!busy_)
+			return -EINVAL;
+		while (aio_error(&cb_) == EINPROGRESS)
+			aio_suspend(cbl, 1, nullptr);
+		return result();
+	}
+
+	void reset() noexcept
+	{
+		if (!busy_)
+			return;
+		aio_cancel(cb_.aio_fildes, &cb_);
+		wait();
+	}
+
+	struct aiocb *get() noexcept
+	{
+		return &cb_;
+	}
+
+private:
+	int submit(int op, int fd, void *buf, size_t n, off_t off, int prio)
+	{
+		int r = 0;
+
+		reset();
+		std::memset(&cb_, 0, sizeof(cb_));
+		cb_.aio_fildes = fd;
+		cb_.aio_buf = buf;
+		cb_.aio_nbytes = n;
+		cb_.aio_offset = off;
+		cb_.aio_reqprio = prio;
+		if ((r = op == LIO_READ ? aio_read(&cb_) : aio_write(&cb_)) == 0)
+			busy_ = true;
+		return r;
+	}
+
+	struct aiocb cb_;
+	bool busy_ = false;
+};
+
+
+template <typename T = void> class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> cont;
+	std::exception_ptr err;
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return {};
+	}
+
+	/* hand over to whoever awaited us */
+	struct final_awaiter {
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			if (h.promise().cont)
+				return h.promise().cont;
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	final_awaiter final_suspend() noexcept
+	{
+		return {};
+	}
+
+	void unhandled_exception() noexcept
+	{
+		err = std::current_exception();
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> val;
+
+	task<T> get_return_object() noexcept;
+
+	template <typename U>
+	void return_value(U &&v)
+	{
+		val.emplace(std::forward<U>(v));
+	}
+
+	T take()
+	{
+		if (err)
+			std::rethrow_exception(err);
+		return std::move(*val);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+
+	void return_void() noexcept
+	{
+	}
+
+	void take()
+	{
+		if (err)
+			std::rethrow_exception(err);
+	}
+};
+
+/* Started right away and gone when done */
+struct detached {
+	struct promise_type {
+		detached get_return_object() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_void() noexcept
+		{
+		}
+
+		void unhandled_exception() noexcept
+		{
+			std::terminate();
+		}
+	};
+};
+
+}
+
+
+/* A lazily started coroutine returning T, to be co_awaited once or given
+ * to executor::spawn() or executor::run().
+ */
+template <typename T>
+class task {
+public:
+	using promise_type = detail::promise<T>;
+
+	explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h)
+	{
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr))
+	{
+	}
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept
+	{
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept
+	{
+		h_.promise().cont = cont;
+		return h_;
+	}
+
+	T await_resume()
+	{
+		return h_.promise().take();
+	}
+
+private:
+	std::coroutine_handle<promise_type> h_;
+};
+
+namespace detail {
+
+template <typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+}
+
+
+class executor;
+
+/* What co_await ex.read(...) and friends wait on. Yields the bytes
+ * transferred or -errno.
+ */
+class operation {
+public:
+	operation(executor &ex, int op, int fd, void *buf, size_t n, off_t off, int prio) noexcept
+		: ex_(&ex), op_(op), fd_(fd), buf_(buf), n_(n), off_(off), prio_(prio)
+	{
+	}
+
+	operation(const operation &) = delete;
+	operation &operator=(const operation &) = delete;
+
+	/* only before it is awaited */
+	operation(operation &&o) noexcept
+		: ex_(o.ex_), op_(o.op_), fd_(o.fd_), buf_(o.buf_), n_(o.n_), off_(o.off_), prio_(o.prio_)
+	{
+	}
+
+	inline ~operation();
+
+	/* aio_fsync() is synchronous here, no need to suspend for it */
+	bool await_ready() noexcept
+	{
+		if (op_ != LIO_NOP)
+			return false;
+		req_.get()->aio_fildes = fd_;
+		res_ = aio_fsync(O_SYNC, req_.get()) < 0 ? -errno : 0;
+		return true;
+	}
+
+	inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+
+	long await_resume() noexcept
+	{
+		return res_;
+	}
+
+private:
+	friend class executor;
+
+	executor *ex_;
+	int op_, fd_;
+	void *buf_;
+	size_t n_;
+	off_t off_;
+	int prio_;
+	long res_ = 0;
+	request req_;
+	std::coroutine_handle<> h_;
+	operation *prev_ = nullptr, *next_ = nullptr;
+};
+
+
+/* Resumes the coroutines waiting for requests on the thread calling run()
+ * or poll(). Waiting is one aio_suspend() over all of them; coroutines
+ * resumed in one go submit their next requests in one io_submit().
+ * Not thread safe: use it from one thread.
+ */
+class executor {
+public:
+	executor() = default;
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	operation read(int fd, void *buf, size_t n, off_t off, int prio = 0) noexcept
+	{
+		return operation(*this, LIO_READ, fd, buf, n, off, prio);
+	}
+
+	operation write(int fd, const void *buf, size_t n, off_t off, int prio = 0) noexcept
+	{
+		return operation(*this, LIO_WRITE, fd, const_cast<void *>(buf), n, off, prio);
+	}
+
+	operation fsync(int fd) noexcept
+	{
+		return operation(*this, LIO_NOP, fd, nullptr, 0, 0, 0);
+	}
+
+	/* Start t; it runs whenever the executor does. Its exception, if
+	 * any, is thrown by run().
+	 */
+	void spawn(task<void> t)
+	{
+		++live_;
+		drive(this, std::move(t));
+	}
+
+	/* Run until all spawned tasks finished */
+	void run()
+	{
+		while (live_ > 0 && waiting_ > 0)
+			poll(nullptr);
+		if (err_)
+			std::rethrow_exception(std::exchange(err_, nullptr));
+	}
+
+	/* Run t (and whatever was spawned) to completion. Throws
+	 * std::logic_error if t waits for something other than this
+	 * executor's requests and so can't finish here.
+	 */
+	template <typename T>
+	T run(task<T> t)
+	{
+		std::optional<T> r;
+
+		spawn(keep(std::move(t), r));
+		run();
+		if (!r)
+			throw std::logic_error("aio::executor::run: task did not finish");
+		return std::move(*r);
+	}
+
+	void run(task<void> t)
+	{
+		bool done = false;
+
+		spawn(keep(std::move(t), done));
+		run();
+		if (!done)
+			throw std::logic_error("aio::executor::run: task did not finish");
+	}
+
+	/* Resume the coroutines whose requests finished, waiting up to
+	 * 'timeout' (NULL: forever) if none did yet. Returns how many.
+	 */
+	size_t poll(const struct timespec *timeout)
+	{
+		operation *o = nullptr, *next = nullptr;
+		std::vector<std::coroutine_handle<>> ready;
+		size_t i = 0, n = 0;
+
+		if (!waiting_)
+			return 0;
+		if (!any_done()) {
+			cbs_.clear();
+			for (o = head_; o; o = o->next_)
+				cbs_.push_back(o->req_.get());
+			aio_suspend(cbs_.data(), (int)cbs_.size(), timeout);
+		}
+
+		/* keep the buffer for the next time, unless someone polls
+		 * from within a coroutine we resume
+		 */
+		ready.swap(ready_);
+		ready.clear();
+		for (o = head_; o; o = next) {
+			next = o->next_;
+			if (!o->req_.done())
+				continue;
+			o->res_ = o->req_.result();
+			ready.push_back(o->h_);
+			unlink(o);
+		}
+
+		aio_plug();
+		for (i = 0, n = ready.size(); i < n; ++i)
+			ready[i].resume();
+		aio_unplug();
+		ready.swap(ready_);
+		return n;
+	}
+
+	size_t waiting() const noexcept
+	{
+		return waiting_;
+	}
+
+private:
+	friend class operation;
+
+	static detail::detached drive(executor *ex, task<void> t)
+	{
+		try {
+			co_await t;
+		} catch (...) {
+			if (!ex->err_)
+				ex->err_ = std::current_exception();
+		}
+		--ex->live_;
+	}
+
+	template <typename T>
+	static task<void> keep(task<T> t, std::optional<T> &r)
+	{
+		r.emplace(co_await t);
+	}
+
+	static task<void> keep(task<void> t, bool &done)
+	{
+		co_await t;
+		done = true;
+	}
+
+	bool any_done() const noexcept
+	{
+		for (operation *o = head_; o; o = o->next_) {
+			if (o->req_.done())
+				return true;
+		}
+		return false;
+	}
+
+	void link(operation *o) noexcept
+	{
+		o->prev_ = nullptr;
+		if ((o->next_ = head_) != nullptr)
+			head_->prev_ = o;
+		head_ = o;
+		++waiting_;
+	}
+
+	void unlink(operation *o) noexcept
+	{
+		if (o->prev_)
+			o->prev_->next_ = o->next_;
+		else
+			head_ = o->next_;
+		if (o->next_)
+			o->next_->prev_ = o->prev_;
+		o->prev_ = o->next_ = nullptr;
+		o->h_ = nullptr;
+		--waiting_;
+	}
+
+	operation *head_ = nullptr;
+	size_t waiting_ = 0, live_ = 0;
+	std::exception_ptr err_;
+	std::vector<const struct aiocb *> cbs_;
+	std::vector<std::coroutine_handle<>> ready_;
+};
+
+
+inline bool operation::await_suspend(std::coroutine_handle<> h) noexcept
+{
+	int r = op_ == LIO_READ ? req_.read(fd_, buf_, n_, off_, prio_) :
+	                          req_.write(fd_, buf_, n_, off_, prio_);
+
+	if (r < 0) {
+		res_ = -errno;
+		return false;
+	}
+	h_ = h;
+	ex_->link(this);
+	return true;
+}
+
+
+/* A coroutine destroyed while waiting: forget it, the request cancels
+ * itself
+ */
+inline operation::~operation()
+{
+	if (h_)
+		ex_->unlink(this);
+}
+
+}
+
+#endif
+
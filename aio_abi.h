@@ -14,6 +14,8 @@ enum {
 	IOCB_CMD_PWRITE = 1,
 	IOCB_CMD_FSYNC = 2,
 	IOCB_CMD_FDSYNC = 3,
+	/* 4 was the experimental IOCB_CMD_PREADX */
+	IOCB_CMD_POLL = 5,
 	IOCB_CMD_NOOP = 6,
 	IOCB_CMD_PREADV = 7,
 	IOCB_CMD_PWRITEV = 8,
@@ -21,6 +23,7 @@ enum {
 
 
 #define IOCB_FLAG_RESFD 1
+#define IOCB_FLAG_IOPRIO (1 << 1)
 
 struct io_event {
 	uint64_t data;
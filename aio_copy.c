@@ -0,0 +1,425 @@
+/* File/device copy engine on top of aio_read()/aio_write(). Reads and
+ * writes are pipelined through a shared ring of aligned buffers.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifndef ANDROID
+#include <linux/fs.h>
+#endif
+
+#include "aio_copy.h"
+#include "aio_sparse.h"
+
+
+enum {
+	SLOT_FREE	= 0,
+	SLOT_READING	= 1,
+	SLOT_WRITING	= 2,
+
+	COPY_ALIGN	= 4096,
+	COPY_CHUNK	= 1024*1024,
+	COPY_DEPTH	= 8
+};
+
+
+struct __cslot {
+	struct aiocb cb;
+	char *buf;
+	size_t off, len, got, put;
+	int state;
+};
+
+
+static int is_offload_errno(int e)
+{
+	return e == EXDEV || e == EINVAL || e == EOPNOTSUPP || e == ENOSYS ||
+	       e == ENOTTY || e == EBADF;
+}
+
+
+/* Try to let the kernel/filesystem do the copy: a reflink first, then
+ * copy_file_range(). The latter goes thru the page cache if it can not
+ * share extents, so it is skipped if any side asked for O_DIRECT. It would
+ * also fill holes, so it is not used in sparse mode either.
+ * Returns 0 if copied, 1 if the caller has to copy itself and -1 on error.
+ */
+static int copy_offload(int in, size_t in_off, int out, size_t out_off, size_t len,
+                        const struct aio_copy_opt *o, size_t *done)
+{
+	struct stat ist, ost;
+	int fl_in = 0, fl_out = 0;
+	size_t step = o->chunk*o->depth, want = 0;
+	ssize_t r = 0;
+	loff_t ioff = in_off, ooff = out_off;
+
+	*done = 0;
+	if (fstat(in, &ist) < 0 || fstat(out, &ost) < 0)
+		return -1;
+	if (!S_ISREG(ist.st_mode) || !S_ISREG(ost.st_mode))
+		return 1;
+	if (len == 0) {
+		if ((size_t)ist.st_size <= in_off)
+			return 0;
+		len = ist.st_size - in_off;
+	}
+
+#ifdef FICLONERANGE
+	{
+		struct file_clone_range fcr = {
+			.src_fd = in,
+			.src_offset = in_off,
+			.src_length = len,
+			.dest_offset = out_off
+		};
+		if (ioctl(out, FICLONERANGE, &fcr) == 0) {
+			*done = len;
+			if (o->progress && o->progress(len, len, o->arg) != 0) {
+				errno = ECANCELED;
+				return -1;
+			}
+			return 0;
+		}
+	}
+#endif
+
+#ifdef __NR_copy_file_range
+	if ((fl_in = fcntl(in, F_GETFL)) < 0 || (fl_out = fcntl(out, F_GETFL)) < 0)
+		return -1;
+	if (((fl_in|fl_out) & O_DIRECT) || (o->flags & AIO_COPY_SPARSE))
+		return 1;
+
+	while (*done < len) {
+		want = len - *done;
+		if (want > step)
+			want = step;
+		r = syscall(__NR_copy_file_range, in, &ioff, out, &ooff, want, 0);
+		if (r < 0) {
+			if (*done == 0 && is_offload_errno(errno))
+				return 1;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		*done += r;
+		if (o->progress && o->progress(*done, len, o->arg) != 0) {
+			errno = ECANCELED;
+			return -1;
+		}
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
+
+
+static int submit(struct __cslot *sl, int fd, size_t out_delta, int opcode)
+{
+	memset(&sl->cb, 0, sizeof(sl->cb));
+	sl->cb.aio_fildes = fd;
+	if (opcode == SLOT_READING) {
+		sl->cb.aio_buf = sl->buf + sl->got;
+		sl->cb.aio_nbytes = sl->len - sl->got;
+		sl->cb.aio_offset = sl->off + sl->got;
+		sl->state = SLOT_READING;
+		return aio_read(&sl->cb);
+	}
+	sl->cb.aio_buf = sl->buf + sl->put;
+	sl->cb.aio_nbytes = sl->got - sl->put;
+	sl->cb.aio_offset = sl->off + out_delta + sl->put;
+	sl->state = SLOT_WRITING;
+	return aio_write(&sl->cb);
+}
+
+
+/* An O_DIRECT write of an unaligned tail (end of device/file) would fail,
+ * so write it thru the page cache, on a descriptor of its own.
+ */
+static ssize_t write_tail(int fd, const char *buf, size_t n, size_t off)
+{
+	ssize_t r = 0;
+	int e = 0, wfd = -1;
+
+	if ((wfd = aio_reopen_buffered(fd)) < 0)
+		return -1;
+	r = pwrite(wfd, buf, n, off);
+	e = errno;
+	close(wfd);
+	errno = e;
+	return r;
+}
+
+
+static int report(const struct aio_copy_opt *o, size_t done, size_t total)
+{
+	if (o->progress && o->progress(done, total, o->arg) != 0)
+		return ECANCELED;
+	return 0;
+}
+
+
+/* Sparse mode: zero the output up to the next data extent of the input and
+ * continue reading there. Returns the number of bytes skipped or -1.
+ */
+static ssize_t skip_hole(int in, int out, size_t delta, int direct, size_t *next, size_t *end, size_t *hole)
+{
+	size_t data = 0, h = SIZE_MAX, skip = 0;
+	int r = 0;
+
+	if ((r = aio_next_data(in, *next, &data, &h)) < 0)
+		return -1;
+	if (r > 0 || data >= *end) {
+		if (*end == SIZE_MAX)
+			*end = *next;
+		data = *end;
+	}
+	if (direct) {
+		data &= ~((size_t)COPY_ALIGN - 1);
+		if (h != SIZE_MAX)
+			h = (h + COPY_ALIGN - 1) & ~((size_t)COPY_ALIGN - 1);
+	}
+	if (data > *next) {
+		skip = data - *next;
+		if (aio_zero_range(out, *next + delta, skip) < 0)
+			return -1;
+		*next = data;
+	}
+	*hole = h;
+	return skip;
+}
+
+
+static long int finish(struct aiocb *cb)
+{
+	int e = aio_error(cb);
+	long int r = aio_return(cb);
+
+	if (e != 0) {
+		errno = e > 0 ? e : EIO;
+		return -1;
+	}
+	return r;
+}
+
+
+ssize_t aio_copy(int in, size_t in_off, int out, size_t out_off, size_t len, const struct aio_copy_opt *opt)
+{
+	struct aio_copy_opt o = {COPY_CHUNK, COPY_DEPTH, 0, NULL, NULL};
+	struct __cslot *slots = NULL, *sl = NULL;
+	const struct aiocb **cbl = NULL;
+	char *pool = NULL;
+	int *free_slots = NULL, nfree = 0, inflight = 0, n = 0, i = 0, eof = 0, err = 0, fl_in = 0, fl_out = 0;
+	size_t next = in_off, end = len ? in_off + len : SIZE_MAX, done = 0, delta = out_off - in_off;
+	size_t hole = SIZE_MAX;
+	ssize_t skip = 0;
+	long int r = 0;
+	struct stat st;
+
+	errno = 0;
+	if (opt)
+		o = *opt;
+	if (o.chunk == 0)
+		o.chunk = COPY_CHUNK;
+	if (o.depth <= 0)
+		o.depth = COPY_DEPTH;
+	if (in < 0 || out < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (!(o.flags & AIO_COPY_NOOFFLOAD)) {
+		if ((i = copy_offload(in, in_off, out, out_off, len, &o, &done)) <= 0)
+			return i < 0 ? -1 : (ssize_t)done;
+	}
+
+	if ((fl_in = fcntl(in, F_GETFL)) < 0 || (fl_out = fcntl(out, F_GETFL)) < 0)
+		return -1;
+	if ((fl_in|fl_out) & O_DIRECT)
+		o.chunk = (o.chunk + COPY_ALIGN - 1) & ~((size_t)COPY_ALIGN - 1);
+
+	/* In sparse mode a trailing hole has to be accounted for, too */
+	if (o.flags & AIO_COPY_SPARSE) {
+		hole = 0;
+		if (len == 0 && fstat(in, &st) == 0 && S_ISREG(st.st_mode))
+			end = (size_t)st.st_size > in_off ? (size_t)st.st_size : in_off;
+	}
+
+	slots = calloc(o.depth, sizeof(*slots));
+	free_slots = calloc(o.depth, sizeof(int));
+	cbl = calloc(o.depth, sizeof(struct aiocb *));
+	if (!slots || !free_slots || !cbl ||
+	    posix_memalign((void **)&pool, COPY_ALIGN, o.depth*o.chunk) != 0) {
+		free(slots);
+		free(free_slots);
+		free(cbl);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < o.depth; ++i) {
+		slots[i].buf = pool + i*o.chunk;
+		free_slots[nfree++] = o.depth - i - 1;
+	}
+
+	for (;;) {
+		/* keep the read side full; EAGAIN just means try again later */
+		while (!eof && !err && next < end && nfree > 0) {
+			if (next >= hole) {
+				if ((skip = skip_hole(in, out, delta, (fl_in|fl_out) & O_DIRECT, &next, &end, &hole)) < 0) {
+					err = errno;
+					break;
+				}
+				done += skip;
+				if (skip > 0 && (err = report(&o, done, len)) != 0)
+					break;
+				if (next >= end)
+					break;
+			}
+			sl = &slots[free_slots[--nfree]];
+			sl->off = next;
+			sl->len = o.chunk;
+			if (end - next < sl->len)
+				sl->len = end - next;
+			if (hole - next < sl->len)
+				sl->len = hole - next;
+			sl->got = sl->put = 0;
+			if (submit(sl, in, delta, SLOT_READING) < 0) {
+				sl->state = SLOT_FREE;
+				++nfree;
+				if (errno != EAGAIN || inflight == 0)
+					err = errno;
+				break;
+			}
+			next += sl->len;
+			++inflight;
+		}
+
+		if (inflight == 0)
+			break;
+
+		for (i = 0, n = 0; i < o.depth; ++i) {
+			if (slots[i].state != SLOT_FREE)
+				cbl[n++] = &slots[i].cb;
+		}
+		/* errors dont matter, each slot is checked below anyway */
+		aio_suspend(cbl, n, NULL);
+
+		for (i = 0; i < o.depth; ++i) {
+			sl = &slots[i];
+			if (sl->state == SLOT_FREE || aio_error(&sl->cb) == EINPROGRESS)
+				continue;
+			--inflight;
+			r = finish(&sl->cb);
+
+			if (sl->state == SLOT_READING) {
+				if (r < 0 && !err)
+					err = errno;
+				if (r > 0) {
+					sl->got += r;
+					if (sl->got < sl->len && !err) {
+						if (submit(sl, in, delta, SLOT_READING) == 0) {
+							++inflight;
+							continue;
+						}
+						err = errno;
+					}
+				}
+				if (sl->got < sl->len && !eof) {
+					eof = 1;
+					if (sl->off + sl->got < end)
+						end = sl->off + sl->got;
+				}
+				if (sl->got == 0 || err) {
+					sl->state = SLOT_FREE;
+					free_slots[nfree++] = i;
+					continue;
+				}
+			} else {
+				if (r <= 0 && !err)
+					err = r < 0 ? errno : ENOSPC;
+				if (r > 0)
+					sl->put += r;
+				if (sl->put == sl->got) {
+					done += sl->got;
+					if (!err)
+						err = report(&o, done, len);
+					sl->state = SLOT_FREE;
+					free_slots[nfree++] = i;
+					continue;
+				}
+				if (err) {
+					sl->state = SLOT_FREE;
+					free_slots[nfree++] = i;
+					continue;
+				}
+			}
+
+			/* (rest of the) data is in, push it out */
+			if ((o.flags & AIO_COPY_SPARSE) && sl->put == 0 && aio_iszero(sl->buf, sl->got)) {
+				if (aio_zero_range(out, sl->off + delta, sl->got) < 0) {
+					if (!err)
+						err = errno;
+				} else {
+					done += sl->got;
+					if (!err)
+						err = report(&o, done, len);
+				}
+				sl->state = SLOT_FREE;
+				free_slots[nfree++] = i;
+			} else if ((fl_out & O_DIRECT) && ((sl->got - sl->put) % COPY_ALIGN)) {
+				if (write_tail(out, sl->buf + sl->put, sl->got - sl->put,
+				               sl->off + delta + sl->put) != (ssize_t)(sl->got - sl->put)) {
+					if (!err)
+						err = errno ? errno : EIO;
+				} else {
+					done += sl->got;
+					if (!err)
+						err = report(&o, done, len);
+				}
+				sl->state = SLOT_FREE;
+				free_slots[nfree++] = i;
+			} else if (submit(sl, out, delta, SLOT_WRITING) < 0) {
+				if (!err)
+					err = errno;
+				sl->state = SLOT_FREE;
+				free_slots[nfree++] = i;
+			} else {
+				++inflight;
+			}
+		}
+	}
+
+	free(pool);
+	free(slots);
+	free(free_slots);
+	free(cbl);
+
+	/* holes at the end of a file are only there if it has the size */
+	if (!err && (o.flags & AIO_COPY_SPARSE) && end != SIZE_MAX &&
+	    fstat(out, &st) == 0 && S_ISREG(st.st_mode) &&
+	    (size_t)st.st_size < out_off + (end - in_off)) {
+		if (ftruncate(out, out_off + (end - in_off)) < 0)
+			err = errno;
+	}
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return done;
+}
+
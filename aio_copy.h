@@ -0,0 +1,44 @@
+/* File/device copy engine on top of aio_read()/aio_write(). Reads and
+ * writes are pipelined through a shared ring of aligned buffers.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_copy_h__
+#define __aio_copy_h__
+
+#include "aio.h"
+
+enum {
+	/* never use reflinks or copy_file_range(), always go thru the ring */
+	AIO_COPY_NOOFFLOAD	= 1,
+
+	/* Only read data extents (SEEK_DATA/SEEK_HOLE) and do not write holes
+	 * or chunks reading as all zeros but punch/zero them on the output.
+	 */
+	AIO_COPY_SPARSE		= 2
+};
+
+/* Called after each written chunk with the number of bytes copied so far
+ * and the total (0 if copying until EOF). Returning non-zero aborts the
+ * copy with ECANCELED.
+ */
+typedef int (*aio_copy_progress_t)(size_t done, size_t total, void *arg);
+
+struct aio_copy_opt {
+	size_t chunk;			/* size of each read/write, default 1M */
+	int depth;			/* number of buffers in the ring, default 8 */
+	int flags;			/* AIO_COPY_* */
+	aio_copy_progress_t progress;	/* may be NULL */
+	void *arg;			/* passed to progress */
+};
+
+/* Copy 'len' bytes (until EOF if 0) from 'in' at 'in_off' to 'out' at
+ * 'out_off'. If 'opt' is NULL, defaults are used. Returns the number of
+ * bytes copied or -1 on error.
+ */
+ssize_t aio_copy(int in, size_t in_off, int out, size_t out_off, size_t len, const struct aio_copy_opt *opt);
+
+#endif
+
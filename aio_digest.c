@@ -0,0 +1,592 @@
+/* Checksums and digests for data read via aio_read_hook(): CRC32C,
+ * SHA-256 and BLAKE3, and a hook folding the chunks of a file into one
+ * digest while the reads are still completing.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include "aio_digest.h"
+
+
+/* CRC32C */
+
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+
+static uint32_t __crc_table[8][256];
+static pthread_once_t __crc_once = PTHREAD_ONCE_INIT;
+static int __crc_hw = 0;
+
+
+static void crc_init(void)
+{
+	uint32_t c = 0;
+	int i = 0, j = 0;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (j = 0; j < 8; ++j)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		__crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i) {
+		for (j = 1; j < 8; ++j)
+			__crc_table[j][i] = (__crc_table[j - 1][i] >> 8) ^ __crc_table[0][__crc_table[j - 1][i] & 0xff];
+	}
+
+#if defined(__x86_64__) && !defined(ANDROID)
+	__builtin_cpu_init();
+	__crc_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(__ARM_FEATURE_CRC32)
+	__crc_hw = 1;
+#endif
+}
+
+
+/* slicing-by-8, independent of byte order */
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	for (; n >= 8; p += 8, n -= 8) {
+		crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+		crc = __crc_table[7][crc & 0xff] ^ __crc_table[6][(crc >> 8) & 0xff] ^
+		      __crc_table[5][(crc >> 16) & 0xff] ^ __crc_table[4][crc >> 24] ^
+		      __crc_table[3][p[4]] ^ __crc_table[2][p[5]] ^
+		      __crc_table[1][p[6]] ^ __crc_table[0][p[7]];
+	}
+	for (; n > 0; --n)
+		crc = __crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+
+#if defined(__x86_64__) && !defined(ANDROID)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	uint64_t c = crc, w = 0;
+
+	for (; n > 0 && ((uintptr_t)p & 7); --n)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, sizeof(w));
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	for (; n > 0; --n)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	uint64_t w = 0;
+
+	for (; n > 0 && ((uintptr_t)p & 7); --n)
+		crc = __crc32cb(crc, *p++);
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, sizeof(w));
+		crc = __crc32cd(crc, w);
+	}
+	for (; n > 0; --n)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#else
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t n)
+{
+	return crc_sw(crc, p, n);
+}
+#endif
+
+
+uint32_t aio_crc32c(uint32_t crc, const void *buf, size_t n)
+{
+	pthread_once(&__crc_once, crc_init);
+	crc = ~crc;
+	if (__crc_hw)
+		crc = crc_hw(crc, buf, n);
+	else
+		crc = crc_sw(crc, buf, n);
+	return ~crc;
+}
+
+
+/* SHA-256, FIPS 180-4 */
+
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void sha256_block(uint32_t h[8], const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i = 0;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i + 1] << 16) | (p[4*i + 2] << 8) | p[4*i + 3];
+	for (; i < 64; ++i) {
+		t1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		t2 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		w[i] = w[i - 16] + t2 + w[i - 7] + t1;
+	}
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; ++i) {
+		t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+
+void aio_sha256_init(struct aio_sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+}
+
+
+void aio_sha256_update(struct aio_sha256 *ctx, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	size_t have = ctx->len % 64, take = 0;
+
+	ctx->len += n;
+	if (have) {
+		take = 64 - have < n ? 64 - have : n;
+		memcpy(ctx->block + have, p, take);
+		p += take;
+		n -= take;
+		if (have + take < 64)
+			return;
+		sha256_block(ctx->h, ctx->block);
+	}
+	for (; n >= 64; p += 64, n -= 64)
+		sha256_block(ctx->h, p);
+	memcpy(ctx->block, p, n);
+}
+
+
+void aio_sha256_final(struct aio_sha256 *ctx, unsigned char out[32])
+{
+	size_t have = ctx->len % 64;
+	uint64_t bits = ctx->len*8;
+	int i = 0;
+
+	ctx->block[have++] = 0x80;
+	if (have > 56) {
+		memset(ctx->block + have, 0, 64 - have);
+		sha256_block(ctx->h, ctx->block);
+		have = 0;
+	}
+	memset(ctx->block + have, 0, 56 - have);
+	for (i = 0; i < 8; ++i)
+		ctx->block[56 + i] = bits >> (56 - 8*i);
+	sha256_block(ctx->h, ctx->block);
+
+	for (i = 0; i < 8; ++i) {
+		out[4*i] = ctx->h[i] >> 24;
+		out[4*i + 1] = ctx->h[i] >> 16;
+		out[4*i + 2] = ctx->h[i] >> 8;
+		out[4*i + 3] = ctx->h[i];
+	}
+}
+
+
+/* BLAKE3, hash mode, following the reference implementation */
+
+enum {
+	B3_CHUNK_START	= 1,
+	B3_CHUNK_END	= 2,
+	B3_PARENT	= 4,
+	B3_ROOT		= 8,
+
+	B3_BLOCK_LEN	= 64,
+	B3_CHUNK_LEN	= 1024
+};
+
+static const uint32_t B3_IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const int B3_PERM[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+
+static void b3_g(uint32_t s[16], int a, int b, int c, int d, uint32_t mx, uint32_t my)
+{
+	s[a] = s[a] + s[b] + mx;
+	s[d] = ROR32(s[d] ^ s[a], 16);
+	s[c] = s[c] + s[d];
+	s[b] = ROR32(s[b] ^ s[c], 12);
+	s[a] = s[a] + s[b] + my;
+	s[d] = ROR32(s[d] ^ s[a], 8);
+	s[c] = s[c] + s[d];
+	s[b] = ROR32(s[b] ^ s[c], 7);
+}
+
+
+static void b3_compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter,
+                        uint32_t len, uint32_t flags, uint32_t out[16])
+{
+	uint32_t s[16], m[16], t[16];
+	int r = 0, i = 0;
+
+	memcpy(s, cv, 8*sizeof(uint32_t));
+	memcpy(s + 8, B3_IV, 4*sizeof(uint32_t));
+	s[12] = (uint32_t)counter;
+	s[13] = (uint32_t)(counter >> 32);
+	s[14] = len;
+	s[15] = flags;
+	memcpy(m, block, sizeof(m));
+
+	for (r = 0; r < 7; ++r) {
+		b3_g(s, 0, 4, 8, 12, m[0], m[1]);
+		b3_g(s, 1, 5, 9, 13, m[2], m[3]);
+		b3_g(s, 2, 6, 10, 14, m[4], m[5]);
+		b3_g(s, 3, 7, 11, 15, m[6], m[7]);
+		b3_g(s, 0, 5, 10, 15, m[8], m[9]);
+		b3_g(s, 1, 6, 11, 12, m[10], m[11]);
+		b3_g(s, 2, 7, 8, 13, m[12], m[13]);
+		b3_g(s, 3, 4, 9, 14, m[14], m[15]);
+		for (i = 0; i < 16; ++i)
+			t[i] = m[B3_PERM[i]];
+		memcpy(m, t, sizeof(m));
+	}
+	for (i = 0; i < 8; ++i) {
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+
+static void b3_words(const unsigned char *p, uint32_t w[16])
+{
+	int i = 0;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = p[4*i] | (p[4*i + 1] << 8) | (p[4*i + 2] << 16) | ((uint32_t)p[4*i + 3] << 24);
+}
+
+
+static uint32_t b3_start_flag(const struct aio_blake3 *ctx)
+{
+	return ctx->blocks_compressed == 0 ? B3_CHUNK_START : 0;
+}
+
+
+/* chaining value of the finished current chunk */
+static void b3_chunk_cv(const struct aio_blake3 *ctx, uint32_t flags, uint32_t out[16])
+{
+	uint32_t w[16];
+	unsigned char block[B3_BLOCK_LEN];
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, ctx->block, ctx->block_len);
+	b3_words(block, w);
+	b3_compress(ctx->cv, w, ctx->chunk_counter, ctx->block_len,
+	            b3_start_flag(ctx) | B3_CHUNK_END | flags, out);
+}
+
+
+static void b3_parent_cv(const uint32_t key[8], const uint32_t l[8], const uint32_t r[8],
+                         uint32_t flags, uint32_t out[16])
+{
+	uint32_t w[16];
+
+	memcpy(w, l, 8*sizeof(uint32_t));
+	memcpy(w + 8, r, 8*sizeof(uint32_t));
+	b3_compress(key, w, 0, B3_BLOCK_LEN, B3_PARENT | flags, out);
+}
+
+
+void aio_blake3_init(struct aio_blake3 *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	memcpy(ctx->key, B3_IV, sizeof(B3_IV));
+	memcpy(ctx->cv, B3_IV, sizeof(B3_IV));
+}
+
+
+void aio_blake3_update(struct aio_blake3 *ctx, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	uint32_t w[16], out[16];
+	uint64_t total = 0;
+	size_t take = 0;
+
+	while (n > 0) {
+		/* current chunk is full and more input follows: merge it into the tree */
+		if (ctx->blocks_compressed*B3_BLOCK_LEN + ctx->block_len == B3_CHUNK_LEN) {
+			b3_chunk_cv(ctx, 0, out);
+			total = ctx->chunk_counter + 1;
+			for (; (total & 1) == 0; total >>= 1)
+				b3_parent_cv(ctx->key, ctx->cv_stack[--ctx->cv_stack_len], out, 0, out);
+			memcpy(ctx->cv_stack[ctx->cv_stack_len++], out, 8*sizeof(uint32_t));
+
+			memcpy(ctx->cv, ctx->key, sizeof(ctx->cv));
+			++ctx->chunk_counter;
+			ctx->block_len = 0;
+			ctx->blocks_compressed = 0;
+		}
+
+		/* a full block is only compressed once we know more input follows */
+		if (ctx->block_len == B3_BLOCK_LEN) {
+			b3_words(ctx->block, w);
+			b3_compress(ctx->cv, w, ctx->chunk_counter, B3_BLOCK_LEN, b3_start_flag(ctx), out);
+			memcpy(ctx->cv, out, sizeof(ctx->cv));
+			++ctx->blocks_compressed;
+			ctx->block_len = 0;
+		}
+
+		take = B3_BLOCK_LEN - ctx->block_len;
+		if (take > n)
+			take = n;
+		memcpy(ctx->block + ctx->block_len, p, take);
+		ctx->block_len += take;
+		p += take;
+		n -= take;
+	}
+}
+
+
+void aio_blake3_final(const struct aio_blake3 *ctx, unsigned char out[32])
+{
+	uint32_t cv[16], root[16];
+	int i = 0;
+
+	if (ctx->cv_stack_len == 0) {
+		b3_chunk_cv(ctx, B3_ROOT, root);
+	} else {
+		b3_chunk_cv(ctx, 0, cv);
+		for (i = ctx->cv_stack_len - 1; i > 0; --i)
+			b3_parent_cv(ctx->key, ctx->cv_stack[i], cv, 0, cv);
+		b3_parent_cv(ctx->key, ctx->cv_stack[0], cv, B3_ROOT, root);
+	}
+
+	for (i = 0; i < 8; ++i) {
+		out[4*i] = root[i];
+		out[4*i + 1] = root[i] >> 8;
+		out[4*i + 2] = root[i] >> 16;
+		out[4*i + 3] = root[i] >> 24;
+	}
+}
+
+
+/* Whole-file digests */
+
+struct __parked {
+	struct aiocb *cb;
+	long int res;
+	struct __parked *next;
+};
+
+struct aio_digest {
+	int type, busy, err;
+	size_t next, eof;
+	pthread_mutex_t lock;
+
+	/* chunks that finished ahead of their turn, by offset */
+	struct __parked *parked;
+
+	union {
+		uint32_t crc;
+		struct aio_sha256 sha;
+		struct aio_blake3 b3;
+	} u;
+};
+
+
+struct aio_digest *aio_digest_new(int type, size_t offset)
+{
+	struct aio_digest *d = NULL;
+
+	if (type != AIO_DIGEST_CRC32C && type != AIO_DIGEST_SHA256 && type != AIO_DIGEST_BLAKE3) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return NULL;
+	d->type = type;
+	d->next = offset;
+	d->eof = SIZE_MAX;
+	pthread_mutex_init(&d->lock, NULL);
+	if (type == AIO_DIGEST_SHA256)
+		aio_sha256_init(&d->u.sha);
+	else if (type == AIO_DIGEST_BLAKE3)
+		aio_blake3_init(&d->u.b3);
+	return d;
+}
+
+
+static void digest_update(struct aio_digest *d, const void *buf, size_t n)
+{
+	if (d->type == AIO_DIGEST_CRC32C)
+		d->u.crc = aio_crc32c(d->u.crc, buf, n);
+	else if (d->type == AIO_DIGEST_SHA256)
+		aio_sha256_update(&d->u.sha, buf, n);
+	else
+		aio_blake3_update(&d->u.b3, buf, n);
+}
+
+
+/* Called with d->lock held: let go every parked chunk at or behind 'off' */
+static void release_parked(struct aio_digest *d, size_t off)
+{
+	struct __parked *p = NULL, **pp = &d->parked;
+
+	while ((p = *pp) != NULL) {
+		if (p->cb->aio_offset >= off) {
+			*pp = p->next;
+			aio_hook_done(p->cb, 0);
+			free(p);
+		} else {
+			pp = &p->next;
+		}
+	}
+}
+
+
+int aio_digest_hook(struct aiocb *aiocbp, long int res, void *arg)
+{
+	struct aio_digest *d = arg;
+	struct __parked *p = NULL, **pp = NULL;
+	struct aiocb *cb = aiocbp;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->err || aiocbp->aio_offset >= d->eof) {
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+	if (res < 0) {
+		d->err = -res;
+		release_parked(d, 0);
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+
+	/* Not our turn yet. Keep the request in progress so that the
+	 * buffer is left alone until it has been hashed.
+	 */
+	if (d->busy || aiocbp->aio_offset != d->next) {
+		if ((p = calloc(1, sizeof(*p))) == NULL) {
+			d->err = ENOMEM;
+			release_parked(d, 0);
+			pthread_mutex_unlock(&d->lock);
+			return ENOMEM;
+		}
+		p->cb = aiocbp;
+		p->res = res;
+		for (pp = &d->parked; *pp && (*pp)->cb->aio_offset < aiocbp->aio_offset; pp = &(*pp)->next)
+			;
+		p->next = *pp;
+		*pp = p;
+		pthread_mutex_unlock(&d->lock);
+		return AIO_HOOK_DEFER;
+	}
+	d->busy = 1;
+	pthread_mutex_unlock(&d->lock);
+
+	/* hash outside of the lock, then continue with whatever queued up */
+	for (;;) {
+		digest_update(d, cb->aio_buf, res);
+		if (cb != aiocbp)
+			aio_hook_done(cb, 0);
+
+		pthread_mutex_lock(&d->lock);
+		d->next += res;
+		if ((size_t)res < cb->aio_nbytes) {
+			d->eof = d->next;
+			release_parked(d, d->eof);
+		}
+		p = d->parked;
+		if (!p || p->cb->aio_offset != d->next || d->err) {
+			d->busy = 0;
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+		d->parked = p->next;
+		pthread_mutex_unlock(&d->lock);
+
+		cb = p->cb;
+		res = p->res;
+		free(p);
+	}
+	return 0;
+}
+
+
+int aio_digest_final(struct aio_digest *d, unsigned char *out)
+{
+	struct aio_sha256 sha;
+	int r = -1;
+
+	if (!d || !out) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (d->err) {
+		errno = d->err;
+	} else if (d->busy || d->parked) {
+		errno = EINPROGRESS;
+	} else if (d->type == AIO_DIGEST_CRC32C) {
+		out[0] = d->u.crc >> 24;
+		out[1] = d->u.crc >> 16;
+		out[2] = d->u.crc >> 8;
+		out[3] = d->u.crc;
+		r = 4;
+	} else if (d->type == AIO_DIGEST_SHA256) {
+		sha = d->u.sha;
+		aio_sha256_final(&sha, out);
+		r = 32;
+	} else {
+		aio_blake3_final(&d->u.b3, out);
+		r = 32;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return r;
+}
+
+
+void aio_digest_free(struct aio_digest *d)
+{
+	if (!d)
+		return;
+	pthread_mutex_lock(&d->lock);
+	release_parked(d, 0);
+	pthread_mutex_unlock(&d->lock);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
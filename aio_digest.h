@@ -0,0 +1,78 @@
+/* Checksums and digests for data read via aio_read_hook(): CRC32C,
+ * SHA-256 and BLAKE3, and a hook folding the chunks of a file into one
+ * digest while the reads are still completing.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_digest_h__
+#define __aio_digest_h__
+
+#include "aio.h"
+
+enum {
+	AIO_DIGEST_CRC32C	= 0,
+	AIO_DIGEST_SHA256	= 1,
+	AIO_DIGEST_BLAKE3	= 2,
+
+	/* large enough for any of the above */
+	AIO_DIGEST_MAX		= 32
+};
+
+
+/* Continue a CRC32C (Castagnoli) over 'n' bytes; start with crc 0 */
+uint32_t aio_crc32c(uint32_t crc, const void *buf, size_t n);
+
+
+struct aio_sha256 {
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char block[64];
+};
+
+void aio_sha256_init(struct aio_sha256 *ctx);
+
+void aio_sha256_update(struct aio_sha256 *ctx, const void *buf, size_t n);
+
+void aio_sha256_final(struct aio_sha256 *ctx, unsigned char out[32]);
+
+
+struct aio_blake3 {
+	uint32_t key[8];
+	uint32_t cv_stack[54][8];
+	int cv_stack_len;
+
+	/* the chunk currently hashed */
+	uint32_t cv[8];
+	uint64_t chunk_counter;
+	unsigned char block[64];
+	int block_len, blocks_compressed;
+};
+
+void aio_blake3_init(struct aio_blake3 *ctx);
+
+void aio_blake3_update(struct aio_blake3 *ctx, const void *buf, size_t n);
+
+void aio_blake3_final(const struct aio_blake3 *ctx, unsigned char out[32]);
+
+
+/* A digest over a file range starting at 'offset'. Pass aio_digest_hook
+ * with the digest as argument to aio_read_hook() for each chunk. Chunks
+ * that complete ahead of their predecessors are held back (their request
+ * stays in progress) until it is their turn, so the buffers must not be
+ * touched before the request finished anyway.
+ */
+struct aio_digest;
+
+struct aio_digest *aio_digest_new(int type, size_t offset);
+
+int aio_digest_hook(struct aiocb *aiocbp, long int res, void *arg);
+
+/* Once all chunks are finished: store the digest and return its length */
+int aio_digest_final(struct aio_digest *d, unsigned char *out);
+
+void aio_digest_free(struct aio_digest *d);
+
+#endif
+
@@ -0,0 +1,691 @@
+/* Bulk reading of many small files: open, stat, read and close each of
+ * them with a bounded number in flight, results coming back thru a
+ * completion queue. Uses io_uring where the kernel has what it takes,
+ * a pool of worker threads otherwise.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "aio_files.h"
+
+/* io_uring is driven by raw syscalls, no liburing. Its headers must know
+ * IORING_FEAT_EXT_ARG (5.11), for waiting with a timeout.
+ */
+#if defined(__has_include) && !defined(ANDROID) && !defined(AIO_NO_URING)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_EXT_ARG
+#define AIO_HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef AIO_HAVE_URING
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#define __NR_io_uring_enter	426
+#endif
+#endif
+
+
+enum {
+	FILES_MAX_DEPTH		= 1024,
+	FILES_MAX_THREADS	= 64,
+
+	/* openat, statx, read and close per file */
+	FILES_STEPS		= 4,
+
+	FILES_OFLAGS		= O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC
+};
+
+
+/* io_uring: a file in flight, opened as 'fd' */
+struct __fslot {
+	struct aio_file *f;
+#ifdef AIO_HAVE_URING
+	struct statx stx;
+#endif
+	int fd, left, err;
+};
+
+
+struct aio_files {
+	int depth, uring;
+
+	/* submitted by the caller and not reaped yet, started and not done */
+	int pending, inflight;
+
+	/* entries not started yet, and finished ones not handed out yet */
+	struct aio_file *wait_head, *wait_tail;
+	struct aio_file *done_head, *done_tail;
+
+	/* io_uring */
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	unsigned *sq_head, *sq_tail, *sq_mask, *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_local, to_submit;
+#ifdef AIO_HAVE_URING
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+#endif
+	struct __fslot *slots;
+	int *free, nfree;
+
+	/* worker pool, the lists above are under 'lock' then */
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	pthread_t *threads;
+	int nthreads, stop;
+};
+
+
+static void list_push(struct aio_file **head, struct aio_file **tail, struct aio_file *f)
+{
+	f->next = NULL;
+	if (*tail)
+		(*tail)->next = f;
+	else
+		*head = f;
+	*tail = f;
+}
+
+
+static struct aio_file *list_pop(struct aio_file **head, struct aio_file **tail)
+{
+	struct aio_file *f = *head;
+
+	if (f && (*head = f->next) == NULL)
+		*tail = NULL;
+	return f;
+}
+
+
+/* Worker pool */
+
+static void read_file(struct aio_file *f)
+{
+	char *p = f->buf;
+	ssize_t r = 0;
+	int fd = -1;
+
+	f->error = 0;
+	f->nread = 0;
+	if ((fd = openat(f->dirfd, f->path, FILES_OFLAGS)) < 0) {
+		f->error = errno;
+		return;
+	}
+	if (fstat(fd, &f->st) < 0) {
+		f->error = errno;
+		close(fd);
+		return;
+	}
+	while ((size_t)f->nread < f->len) {
+		if ((r = read(fd, p + f->nread, f->len - f->nread)) < 0) {
+			if (errno == EINTR)
+				continue;
+			f->error = errno;
+			break;
+		}
+		if (r == 0)
+			break;
+		f->nread += r;
+	}
+	close(fd);
+}
+
+
+static void *__files_worker(void *vp)
+{
+	struct aio_files *q = vp;
+	struct aio_file *f = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!q->stop && !q->wait_head)
+			pthread_cond_wait(&q->work, &q->lock);
+		if (q->stop)
+			break;
+		f = list_pop(&q->wait_head, &q->wait_tail);
+		++q->inflight;
+		pthread_mutex_unlock(&q->lock);
+
+		read_file(f);
+
+		pthread_mutex_lock(&q->lock);
+		--q->inflight;
+		list_push(&q->done_head, &q->done_tail, f);
+		pthread_cond_signal(&q->done);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+
+static int pool_init(struct aio_files *q)
+{
+	pthread_condattr_t ca;
+	int i = 0;
+
+	q->nthreads = q->depth < FILES_MAX_THREADS ? q->depth : FILES_MAX_THREADS;
+	if ((q->threads = calloc(q->nthreads, sizeof(pthread_t))) == NULL)
+		return -1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->done, &ca);
+	pthread_condattr_destroy(&ca);
+
+	for (i = 0; i < q->nthreads; ++i) {
+		if (pthread_create(&q->threads[i], NULL, __files_worker, q) != 0)
+			break;
+	}
+	if ((q->nthreads = i) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int pool_reap(struct aio_files *q, struct aio_file *done[], int max, const struct timespec *timeout)
+{
+	struct timespec abs;
+	int n = 0, r = 0;
+
+	if (timeout) {
+		clock_gettime(CLOCK_MONOTONIC, &abs);
+		abs.tv_sec += timeout->tv_sec;
+		if ((abs.tv_nsec += timeout->tv_nsec) >= 1000000000) {
+			abs.tv_nsec -= 1000000000;
+			++abs.tv_sec;
+		}
+	}
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->done_head && r == 0) {
+		if (timeout)
+			r = pthread_cond_timedwait(&q->done, &q->lock, &abs);
+		else
+			pthread_cond_wait(&q->done, &q->lock);
+	}
+	while (n < max && q->done_head)
+		done[n++] = list_pop(&q->done_head, &q->done_tail);
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+
+static void pool_close(struct aio_files *q)
+{
+	int i = 0;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->work);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < q->nthreads; ++i)
+		pthread_join(q->threads[i], NULL);
+	pthread_cond_destroy(&q->work);
+	pthread_cond_destroy(&q->done);
+	pthread_mutex_destroy(&q->lock);
+	free(q->threads);
+}
+
+
+#ifdef AIO_HAVE_URING
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/* io_uring: each file is an openat, and once it completed a hard linked
+ * statx on the fd -> read. Like the pool, the stat is of the file that is
+ * read, not of whatever the path names at some other time. A short read is
+ * continued where it stopped until EOF or 'len', then the fd is closed, also
+ * if a step failed (e.g. the read with EISDIR). Every step posts a
+ * completion; the steps of all files go to the kernel with one
+ * io_uring_enter().
+ */
+static int uring_init(struct aio_files *q)
+{
+	struct io_uring_params p;
+	int i = 0;
+
+	/* Completions are only looked at when we ask for them, so the kernel
+	 * may as well hold back their work until then (6.1+)
+	 */
+	memset(&p, 0, sizeof(p));
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	p.flags = IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN;
+#endif
+	if ((q->ring_fd = syscall(__NR_io_uring_setup, FILES_STEPS*q->depth, &p)) < 0) {
+		memset(&p, 0, sizeof(p));
+		if ((q->ring_fd = syscall(__NR_io_uring_setup, FILES_STEPS*q->depth, &p)) < 0)
+			return -1;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		close(q->ring_fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	q->sq_ring_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	q->cq_ring_sz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && q->cq_ring_sz > q->sq_ring_sz)
+		q->sq_ring_sz = q->cq_ring_sz;
+	q->sqes_sz = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	q->sq_ring = mmap(NULL, q->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	                  q->ring_fd, IORING_OFF_SQ_RING);
+	if (q->sq_ring == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		q->cq_ring = q->sq_ring;
+	} else {
+		q->cq_ring = mmap(NULL, q->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		                  q->ring_fd, IORING_OFF_CQ_RING);
+		if (q->cq_ring == MAP_FAILED) {
+			q->cq_ring = NULL;
+			goto fail;
+		}
+	}
+	q->sqes = mmap(NULL, q->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	               q->ring_fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED) {
+		q->sqes = NULL;
+		goto fail;
+	}
+
+	q->sq_head = (unsigned *)((char *)q->sq_ring + p.sq_off.head);
+	q->sq_tail = (unsigned *)((char *)q->sq_ring + p.sq_off.tail);
+	q->sq_mask = (unsigned *)((char *)q->sq_ring + p.sq_off.ring_mask);
+	q->cq_head = (unsigned *)((char *)q->cq_ring + p.cq_off.head);
+	q->cq_tail = (unsigned *)((char *)q->cq_ring + p.cq_off.tail);
+	q->cq_mask = (unsigned *)((char *)q->cq_ring + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)((char *)q->cq_ring + p.cq_off.cqes);
+
+	/* SQEs are used in ring order, so the index array never changes */
+	for (i = 0; i < (int)p.sq_entries; ++i)
+		((unsigned *)((char *)q->sq_ring + p.sq_off.array))[i] = i;
+	q->sq_local = *q->sq_tail;
+
+	q->slots = calloc(q->depth, sizeof(struct __fslot));
+	q->free = malloc(q->depth*sizeof(int));
+	if (!q->slots || !q->free)
+		goto fail;
+	for (i = 0; i < q->depth; ++i)
+		q->free[i] = q->depth - 1 - i;
+	q->nfree = q->depth;
+	return 0;
+
+fail:
+	if (q->sqes)
+		munmap(q->sqes, q->sqes_sz);
+	if (q->cq_ring && q->cq_ring != q->sq_ring)
+		munmap(q->cq_ring, q->cq_ring_sz);
+	if (q->sq_ring != MAP_FAILED)
+		munmap(q->sq_ring, q->sq_ring_sz);
+	free(q->slots);
+	free(q->free);
+	close(q->ring_fd);
+	return -1;
+}
+
+
+/* There is always room: at most FILES_STEPS SQEs per slot are unsubmitted */
+static struct io_uring_sqe *get_sqe(struct aio_files *q, int slot, int step, int flags)
+{
+	struct io_uring_sqe *sqe = &q->sqes[q->sq_local++ & *q->sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)slot*FILES_STEPS + step;
+	sqe->flags = flags;
+	++q->to_submit;
+	return sqe;
+}
+
+
+static void uring_start(struct aio_files *q, struct aio_file *f)
+{
+	int i = q->free[--q->nfree];
+	struct __fslot *s = &q->slots[i];
+	struct io_uring_sqe *sqe = NULL;
+
+	s->f = f;
+	s->fd = -1;
+	s->left = 1;
+	s->err = 0;
+	f->error = 0;
+	f->nread = 0;
+
+	sqe = get_sqe(q, i, 0, 0);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = f->dirfd;
+	sqe->addr = (uintptr_t)f->path;
+	sqe->open_flags = FILES_OFLAGS;
+
+	++q->inflight;
+}
+
+
+/* Read the file of slot 'i' on from where the last read stopped */
+static void uring_read(struct aio_files *q, int i)
+{
+	struct __fslot *s = &q->slots[i];
+	struct io_uring_sqe *sqe = get_sqe(q, i, 2, 0);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)((char *)s->f->buf + s->f->nread);
+	sqe->len = s->f->len - s->f->nread;
+	/* at the file position, as read() in the pool */
+	sqe->off = (uint64_t)-1;
+	++s->left;
+}
+
+
+/* The file of slot 'i' is open: stat it, then read it */
+static void uring_stat(struct aio_files *q, int i)
+{
+	static const char empty[] = "";
+	struct __fslot *s = &q->slots[i];
+	struct io_uring_sqe *sqe = get_sqe(q, i, 1, IOSQE_IO_HARDLINK);
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)empty;
+	sqe->statx_flags = AT_EMPTY_PATH;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)&s->stx;
+	++s->left;
+	uring_read(q, i);
+}
+
+
+static void uring_closefd(struct aio_files *q, int i)
+{
+	struct __fslot *s = &q->slots[i];
+	struct io_uring_sqe *sqe = get_sqe(q, i, 3, 0);
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = s->fd;
+	++s->left;
+}
+
+
+static void stat_from_statx(struct stat *st, const struct statx *stx)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+
+/* Collect the completions, queueing the rest of the steps of the files
+ * that got opened. A file is done once all its steps reported; the first
+ * error counts.
+ */
+static void uring_complete(struct aio_files *q)
+{
+	unsigned head = *q->cq_head, tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe = NULL;
+	struct __fslot *s = NULL;
+	int i = 0, step = 0;
+
+	for (; head != tail; ++head) {
+		cqe = &q->cqes[head & *q->cq_mask];
+		i = cqe->user_data/FILES_STEPS;
+		step = cqe->user_data % FILES_STEPS;
+		s = &q->slots[i];
+
+		if (cqe->res < 0 && cqe->res != -ECANCELED && step != 3 && !s->err)
+			s->err = -cqe->res;
+		if (step == 0 && cqe->res >= 0) {
+			s->fd = cqe->res;
+			uring_stat(q, i);
+		} else if (step == 2) {
+			/* like the pool: on until EOF or 'len' */
+			if (cqe->res > 0)
+				s->f->nread += cqe->res;
+			if (cqe->res > 0 && (size_t)s->f->nread < s->f->len)
+				uring_read(q, i);
+			else
+				uring_closefd(q, i);
+		}
+		if (--s->left > 0)
+			continue;
+
+		if ((s->f->error = s->err) == 0)
+			stat_from_statx(&s->f->st, &s->stx);
+		list_push(&q->done_head, &q->done_tail, s->f);
+		s->f = NULL;
+		q->free[q->nfree++] = i;
+		--q->inflight;
+	}
+	__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* Start what the free slots allow and pass the new SQEs to the kernel.
+ * With 'wait', also wait for a completion, up to 'ns' if not negative.
+ */
+static int uring_enter(struct aio_files *q, int wait, int64_t ns)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int r = 0;
+
+	while (q->nfree > 0 && q->wait_head)
+		uring_start(q, list_pop(&q->wait_head, &q->wait_tail));
+	if (q->to_submit == 0 && !wait)
+		return 0;
+	__atomic_store_n(q->sq_tail, q->sq_local, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (wait) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (ns >= 0) {
+			ts.tv_sec = ns/1000000000;
+			ts.tv_nsec = ns%1000000000;
+			arg.ts = (uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+	r = syscall(__NR_io_uring_enter, q->ring_fd, q->to_submit, wait ? 1 : 0, flags,
+	            (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+	            (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+	if (r < 0)
+		return -1;
+	q->to_submit -= r;
+	return 0;
+}
+
+
+static int uring_reap(struct aio_files *q, struct aio_file *done[], int max, const struct timespec *timeout)
+{
+	int64_t end = 0, left = -1;
+	int n = 0;
+
+	if (timeout)
+		end = now_ns() + (int64_t)timeout->tv_sec*1000000000 + timeout->tv_nsec;
+	for (;;) {
+		uring_complete(q);
+		if (q->done_head)
+			break;
+		if (timeout && (left = end - now_ns()) < 0)
+			left = 0;
+		if (uring_enter(q, 1, left) < 0) {
+			if (errno == ETIME)
+				break;
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				return -1;
+		}
+	}
+	/* the files opened meanwhile should not wait for the next call */
+	if (q->to_submit > 0)
+		uring_enter(q, 0, -1);
+	while (n < max && q->done_head)
+		done[n++] = list_pop(&q->done_head, &q->done_tail);
+	return n;
+}
+
+
+static void uring_close(struct aio_files *q)
+{
+	while (q->inflight > 0) {
+		uring_complete(q);
+		if (q->inflight > 0 && uring_enter(q, 1, -1) < 0 && errno != EINTR)
+			break;
+	}
+	munmap(q->sqes, q->sqes_sz);
+	if (q->cq_ring != q->sq_ring)
+		munmap(q->cq_ring, q->cq_ring_sz);
+	munmap(q->sq_ring, q->sq_ring_sz);
+	close(q->ring_fd);
+	free(q->slots);
+	free(q->free);
+}
+
+#endif
+
+
+struct aio_files *aio_files_open(int depth, int flags)
+{
+	struct aio_files *q = NULL;
+
+	if (depth <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		return NULL;
+	q->depth = depth < FILES_MAX_DEPTH ? depth : FILES_MAX_DEPTH;
+	q->ring_fd = -1;
+
+#ifdef AIO_HAVE_URING
+	if (!(flags & AIO_FILES_POOL) && uring_init(q) == 0) {
+		q->uring = 1;
+		return q;
+	}
+#endif
+	if (pool_init(q) < 0) {
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+
+int aio_files_submit(struct aio_files *q, struct aio_file *const list[], int n)
+{
+	int i = 0;
+
+	if (!q || n < 0 || (n > 0 && !list)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!q->uring)
+		pthread_mutex_lock(&q->lock);
+	for (i = 0; i < n; ++i)
+		list_push(&q->wait_head, &q->wait_tail, list[i]);
+	q->pending += n;
+	if (!q->uring) {
+		pthread_cond_broadcast(&q->work);
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+	}
+#ifdef AIO_HAVE_URING
+	/* get them going; on errors, the next aio_files_reap() tries again */
+	uring_enter(q, 0, -1);
+#endif
+	return 0;
+}
+
+
+int aio_files_reap(struct aio_files *q, struct aio_file *done[], int max, const struct timespec *timeout)
+{
+	int n = 0;
+
+	if (!q || max <= 0 || !done) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (q->pending == 0)
+		return 0;
+#ifdef AIO_HAVE_URING
+	if (q->uring)
+		n = uring_reap(q, done, max, timeout);
+	else
+#endif
+		n = pool_reap(q, done, max, timeout);
+	if (n > 0)
+		q->pending -= n;
+	return n;
+}
+
+
+int aio_files_pending(const struct aio_files *q)
+{
+	return q->pending;
+}
+
+
+int aio_files_uring(const struct aio_files *q)
+{
+	return q->uring;
+}
+
+
+void aio_files_close(struct aio_files *q)
+{
+	if (!q)
+		return;
+#ifdef AIO_HAVE_URING
+	if (q->uring)
+		uring_close(q);
+	else
+#endif
+		pool_close(q);
+	free(q);
+}
+
@@ -0,0 +1,73 @@
+/* Bulk reading of many small files: open, stat, read and close each of
+ * them with a bounded number in flight, results coming back thru a
+ * completion queue. Uses io_uring where the kernel has what it takes,
+ * a pool of worker threads otherwise.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_files_h__
+#define __aio_files_h__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct aio_files;
+
+/* One file to read. The caller fills in the first four members and keeps
+ * the entry, the path and the buffer around until it is handed back by
+ * aio_files_reap().
+ */
+struct aio_file {
+	int dirfd;		/* as for openat(), e.g. AT_FDCWD */
+	const char *path;
+	void *buf;
+	size_t len;		/* size of buf */
+
+	/* results */
+	int error;		/* 0 or the errno of the step that failed */
+	ssize_t nread;		/* bytes read into buf, at most len */
+	struct stat st;		/* if error is 0, of the file read; st_size may exceed len */
+
+	void *data;		/* for the caller */
+	struct aio_file *next;	/* used by the queue */
+};
+
+enum {
+	/* use the worker pool even if io_uring is there */
+	AIO_FILES_POOL		= 1
+};
+
+/* A queue keeping up to 'depth' files in flight, each taking an fd while
+ * it is open. 'flags' is a set of AIO_FILES_*. The queue is meant to be
+ * used by one thread, the one that opened it. NULL and errno on failure.
+ */
+struct aio_files *aio_files_open(int depth, int flags);
+
+/* Queue the 'n' entries of 'list', in order. They are started as slots
+ * become free, also from within aio_files_reap(). Files are opened
+ * O_RDONLY|O_NONBLOCK, so FIFOs are not waited for. Returns 0 or -1.
+ */
+int aio_files_submit(struct aio_files *q, struct aio_file *const list[], int n);
+
+/* Hand out up to 'max' finished entries in 'done', waiting up to 'timeout'
+ * (NULL: forever) for at least one. Returns their number, 0 on timeout or
+ * if nothing is queued, -1 on error.
+ */
+int aio_files_reap(struct aio_files *q, struct aio_file *done[], int max, const struct timespec *timeout);
+
+/* Number of entries submitted but not reaped yet */
+int aio_files_pending(const struct aio_files *q);
+
+/* 1 if the queue runs on io_uring, 0 for the worker pool */
+int aio_files_uring(const struct aio_files *q);
+
+/* Waits for the files in flight and frees the queue. Entries not reaped
+ * yet are dropped.
+ */
+void aio_files_close(struct aio_files *q);
+
+#endif
+
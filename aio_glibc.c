@@ -0,0 +1,122 @@
+/* The glibc side of libaio-posix.so: the *64 variants, aio_init() and the
+ * symbol versions of glibc's AIO, so that the library can be LD_PRELOADed
+ * into programs built against glibc's <aio.h> and -lrt. Built together with
+ * aio.c and AIO_GLIBC_LAYOUT, see libaio-posix.map.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+
+#include "aio.h"
+
+
+#ifndef AIO_GLIBC_LAYOUT
+#error "aio_glibc.c needs the glibc layout of struct aiocb (-DAIO_GLIBC_LAYOUT)"
+#endif
+
+/* glibc's struct aiocb has 168 bytes on 64 bit, with aio_offset at 128. The
+ * offsetof() as array size makes it fail to compile otherwise.
+ */
+#ifdef __x86_64__
+typedef char __aiocb_size_check[sizeof(struct aiocb) == 168 ? 1 : -1];
+typedef char __aiocb_offset_check[offsetof(struct aiocb, aio_offset) == 128 ? 1 : -1];
+#endif
+
+
+/* With 64 bit off_t, struct aiocb64 is struct aiocb */
+int aio_read64(struct aiocb *aiocbp)
+{
+	return aio_read(aiocbp);
+}
+
+
+int aio_write64(struct aiocb *aiocbp)
+{
+	return aio_write(aiocbp);
+}
+
+
+int aio_fsync64(int op, struct aiocb *aiocbp)
+{
+	return aio_fsync(op, aiocbp);
+}
+
+
+int aio_error64(struct aiocb *aiocbp)
+{
+	return aio_error(aiocbp);
+}
+
+
+int aio_cancel64(int fd, struct aiocb *aiocbp)
+{
+	return aio_cancel(fd, aiocbp);
+}
+
+
+int aio_suspend64(const struct aiocb *const cblist[], int n, const struct timespec *timeout)
+{
+	return aio_suspend(cblist, n, timeout);
+}
+
+
+long int aio_return64(struct aiocb *aiocbp)
+{
+	return aio_return(aiocbp);
+}
+
+
+int lio_listio64(int mode, struct aiocb *const list[], int nent, struct sigevent *sig)
+{
+	return lio_listio(mode, list, nent, sig);
+}
+
+
+/* Tuning for glibc's thread pool. There is none here. */
+struct aioinit;
+
+void aio_init(const struct aioinit *init)
+{
+}
+
+
+/* Programs linked before glibc 2.34 reference the librt versions (and the
+ * lio_listio() of 2.4), later ones the libc versions, which are the default
+ * here. The x86_64 names; other architectures start off other versions.
+ */
+#ifdef __x86_64__
+
+#define AIO_COMPAT(ret, name, tag, ver, params, args) \
+	ret __##name##_##tag params { return name args; } \
+	__asm__(".symver __" #name "_" #tag ", " #name "@GLIBC_" ver)
+
+AIO_COMPAT(int, aio_read, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_read64, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_write, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_write64, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_fsync, 225, "2.2.5", (int op, struct aiocb *a), (op, a));
+AIO_COMPAT(int, aio_fsync64, 225, "2.2.5", (int op, struct aiocb *a), (op, a));
+AIO_COMPAT(int, aio_error, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_error64, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, aio_cancel, 225, "2.2.5", (int fd, struct aiocb *a), (fd, a));
+AIO_COMPAT(int, aio_cancel64, 225, "2.2.5", (int fd, struct aiocb *a), (fd, a));
+AIO_COMPAT(int, aio_suspend, 225, "2.2.5", (const struct aiocb *const l[], int n, const struct timespec *t), (l, n, t));
+AIO_COMPAT(int, aio_suspend64, 225, "2.2.5", (const struct aiocb *const l[], int n, const struct timespec *t), (l, n, t));
+AIO_COMPAT(long int, aio_return, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(long int, aio_return64, 225, "2.2.5", (struct aiocb *a), (a));
+AIO_COMPAT(int, lio_listio, 225, "2.2.5", (int m, struct aiocb *const l[], int n, struct sigevent *s), (m, l, n, s));
+AIO_COMPAT(int, lio_listio64, 225, "2.2.5", (int m, struct aiocb *const l[], int n, struct sigevent *s), (m, l, n, s));
+AIO_COMPAT(int, lio_listio, 24, "2.4", (int m, struct aiocb *const l[], int n, struct sigevent *s), (m, l, n, s));
+AIO_COMPAT(int, lio_listio64, 24, "2.4", (int m, struct aiocb *const l[], int n, struct sigevent *s), (m, l, n, s));
+
+
+void __aio_init_225(const struct aioinit *init)
+{
+}
+__asm__(".symver __aio_init_225, aio_init@GLIBC_2.2.5");
+
+#endif
+
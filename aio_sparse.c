@@ -0,0 +1,142 @@
+/* Helpers for hole-aware (sparse) reading and writing, used by aio_stream
+ * and aio_copy in their sparse modes.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "aio_sparse.h"
+
+
+enum {
+	ZERO_ALIGN	= 4096,
+	ZERO_BUFSIZE	= 64*1024,
+
+	/* bytes OR-ed together between two early-exit checks */
+	ZERO_STRIDE	= 256
+};
+
+/* GCC vector extension; the compiler emits SSE2/AVX2/NEON for it */
+typedef uint64_t __v4du __attribute__((vector_size(32), may_alias));
+
+static const char __zeros[ZERO_BUFSIZE] __attribute__((aligned(ZERO_ALIGN)));
+
+
+int aio_next_data(int fd, size_t off, size_t *data, size_t *hole)
+{
+	off_t d = 0, h = 0;
+
+	if ((d = lseek(fd, off, SEEK_DATA)) < 0) {
+		if (errno == ENXIO)
+			return 1;
+		if (errno != EINVAL)
+			return -1;
+		/* no SEEK_DATA support, so its all data */
+		*data = off;
+		*hole = SIZE_MAX;
+		return 0;
+	}
+	if ((h = lseek(fd, d, SEEK_HOLE)) < 0)
+		return -1;
+	*data = d;
+	*hole = h;
+	return 0;
+}
+
+
+/* Runtime dispatch to an AVX2 clone where ifuncs are available */
+#if defined(__x86_64__) && !defined(ANDROID) && __GNUC__ >= 6
+__attribute__((target_clones("avx2", "default")))
+#endif
+int aio_iszero(const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	const __v4du *v = NULL;
+	__v4du acc = {0, 0, 0, 0};
+	size_t i = 0, j = 0;
+
+	for (; i < n && ((uintptr_t)(p + i) % sizeof(__v4du)); ++i) {
+		if (p[i])
+			return 0;
+	}
+
+	for (; i + ZERO_STRIDE <= n; i += ZERO_STRIDE) {
+		v = (const __v4du *)(p + i);
+		for (j = 0; j < ZERO_STRIDE/sizeof(__v4du); ++j)
+			acc |= v[j];
+		if (acc[0] | acc[1] | acc[2] | acc[3])
+			return 0;
+	}
+
+	for (; i < n; ++i) {
+		if (p[i])
+			return 0;
+	}
+	return 1;
+}
+
+
+int aio_reopen_buffered(int fd)
+{
+	char path[64];
+	int flags = 0;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, (flags & ~O_DIRECT)|O_CLOEXEC);
+}
+
+
+int aio_zero_range(int fd, size_t off, size_t len)
+{
+	int flags = 0, e = 0, wfd = fd;
+	size_t n = 0;
+	ssize_t r = 0;
+
+	if (len == 0)
+		return 0;
+
+	/* On block devices these end up as discard or write-zeroes */
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return 0;
+#endif
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, off, len) == 0)
+		return 0;
+#endif
+
+	/* No luck, write them. Unaligned ranges can not go thru O_DIRECT. */
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		return -1;
+	if ((flags & O_DIRECT) && ((off | len) % ZERO_ALIGN) && (wfd = aio_reopen_buffered(fd)) < 0)
+		return -1;
+
+	for (; len > 0; off += r, len -= r) {
+		n = len < sizeof(__zeros) ? len : sizeof(__zeros);
+		if ((r = pwrite(wfd, __zeros, n, off)) <= 0) {
+			e = r < 0 ? errno : ENOSPC;
+			break;
+		}
+	}
+
+	if (wfd != fd)
+		close(wfd);
+	if (e) {
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
@@ -0,0 +1,37 @@
+/* Helpers for hole-aware (sparse) reading and writing, used by aio_stream
+ * and aio_copy in their sparse modes.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_sparse_h__
+#define __aio_sparse_h__
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Find the first data extent at or after 'off' via SEEK_DATA/SEEK_HOLE and
+ * store it as [*data, *hole). Returns 0 on success, 1 if there is no more
+ * data and -1 on error. Filesystems and devices without hole support
+ * report everything up to EOF as data.
+ */
+int aio_next_data(int fd, size_t off, size_t *data, size_t *hole);
+
+/* Returns 1 if 'n' bytes at 'buf' are all zero, 0 otherwise */
+int aio_iszero(const void *buf, size_t n);
+
+/* Make [off, off + len) of 'fd' read back as zeros without writing them if
+ * possible: punch a hole in files, discard/zero-out on block devices.
+ */
+int aio_zero_range(int fd, size_t off, size_t len);
+
+/* A new descriptor for the file of 'fd', opened like it but without
+ * O_DIRECT, for writes that can not be aligned. Toggling O_DIRECT on 'fd'
+ * itself would change it for everyone sharing the open file description.
+ * Goes thru /proc/self/fd. Returns the fd or -1; close it when done.
+ */
+int aio_reopen_buffered(int fd);
+
+#endif
+
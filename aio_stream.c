@@ -0,0 +1,396 @@
+/* Sequential streaming reader on top of aio_read(). Keeps a number of
+ * aligned chunks in flight ahead of the consumer and hands out the filled
+ * buffers in file order without copying them.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "aio_stream.h"
+#include "aio_sparse.h"
+
+
+enum {
+	SLOT_FREE	= 0,
+	SLOT_INFLIGHT	= 1,
+	SLOT_HANDED	= 2,
+
+	/* Good for any logical block size in use today */
+	STREAM_ALIGN	= 4096,
+
+	/* number of delivered chunks per throughput sample */
+	STREAM_WINDOW	= 16
+};
+
+
+struct __slot {
+	struct aiocb cb;
+	char *buf;
+	size_t off, len, got;
+	int state;
+};
+
+
+struct aio_stream {
+	int fd, eof, flags, direct;
+	size_t next, end, chunk;
+
+	/* sparse mode: end of the current data extent */
+	size_t hole;
+
+	char *pool;
+	struct __slot *slots;
+
+	/* in-flight slots in file order, and the stack of free slots */
+	int *fifo, head, count;
+	int *free, nfree;
+
+	int max_depth, depth;
+
+	/* depth adaptation */
+	struct timespec t0;
+	size_t bytes;
+	int delivered, dir;
+	double last_rate;
+};
+
+
+static int submit_slot(struct aio_stream *s, struct __slot *sl)
+{
+	memset(&sl->cb, 0, sizeof(sl->cb));
+	sl->cb.aio_fildes = s->fd;
+	sl->cb.aio_buf = sl->buf + sl->got;
+	sl->cb.aio_nbytes = sl->len - sl->got;
+	sl->cb.aio_offset = sl->off + sl->got;
+	return aio_read(&sl->cb);
+}
+
+
+/* Sparse mode: move s->next to the next data extent and remember where it
+ * ends. With O_DIRECT the extent is widened to the alignment.
+ */
+static int next_extent(struct aio_stream *s)
+{
+	size_t data = 0, hole = 0;
+	int r = 0;
+
+	if ((r = aio_next_data(s->fd, s->next, &data, &hole)) < 0)
+		return -1;
+	if (r > 0 || data >= s->end) {
+		s->end = s->next;
+		return 0;
+	}
+	if (s->direct) {
+		data &= ~((size_t)STREAM_ALIGN - 1);
+		if (hole != SIZE_MAX)
+			hole = (hole + STREAM_ALIGN - 1) & ~((size_t)STREAM_ALIGN - 1);
+	}
+	if (data > s->next)
+		s->next = data;
+	s->hole = hole;
+	return 0;
+}
+
+
+/* Keep up to s->depth reads in flight. Running into kernel limits (EAGAIN)
+ * is not an error as long as something is in flight already; we just try
+ * again on the next call.
+ */
+static int refill(struct aio_stream *s)
+{
+	int idx = 0, r = 0, e = 0;
+	struct __slot *sl = NULL;
+
+	/* one io_submit() for all of them */
+	aio_plug();
+	while (!s->eof && s->count < s->depth && s->nfree > 0 && s->next < s->end) {
+		if (s->next >= s->hole && next_extent(s) < 0) {
+			r = -1;
+			break;
+		}
+		if (s->next >= s->end)
+			break;
+		idx = s->free[--s->nfree];
+		sl = &s->slots[idx];
+		sl->off = s->next;
+		sl->len = s->chunk;
+		if (s->end - s->next < sl->len)
+			sl->len = s->end - s->next;
+		if (s->hole - s->next < sl->len)
+			sl->len = s->hole - s->next;
+		sl->got = 0;
+		if (submit_slot(s, sl) < 0) {
+			s->free[s->nfree++] = idx;
+			if (errno != EAGAIN || s->count == 0)
+				r = -1;
+			break;
+		}
+		sl->state = SLOT_INFLIGHT;
+		s->fifo[(s->head + s->count) % s->max_depth] = idx;
+		++s->count;
+		s->next += sl->len;
+	}
+	e = errno;
+	aio_unplug();
+	errno = e;
+	return r;
+}
+
+
+/* Wait for a single in-flight read and return its aio_return() value */
+static long int wait_slot(struct __slot *sl)
+{
+	int e = 0;
+	const struct aiocb *cbl[1] = {&sl->cb};
+
+	while ((e = aio_error(&sl->cb)) == EINPROGRESS) {
+		if (aio_suspend(cbl, 1, NULL) < 0 && errno != EINTR)
+			return -1;
+	}
+	if (e < 0)
+		return -1;
+	if (e != 0) {
+		aio_return(&sl->cb);
+		errno = e;
+		return -1;
+	}
+	return aio_return(&sl->cb);
+}
+
+
+/* Hill climbing on the delivered throughput: keep changing the depth in the
+ * same direction as long as it pays off, turn around otherwise.
+ */
+static void adapt(struct aio_stream *s)
+{
+	struct timespec now;
+	double secs = 0, rate = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - s->t0.tv_sec) + (now.tv_nsec - s->t0.tv_nsec)/1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+	rate = s->bytes/secs;
+
+	if (s->last_rate > 0 && rate < s->last_rate*1.05)
+		s->dir = -s->dir;
+	s->depth += s->dir;
+	if (s->depth < 1) {
+		s->depth = 1;
+		s->dir = 1;
+	} else if (s->depth > s->max_depth) {
+		s->depth = s->max_depth;
+		s->dir = -1;
+	}
+
+	s->last_rate = rate;
+	s->bytes = 0;
+	s->delivered = 0;
+	s->t0 = now;
+}
+
+
+struct aio_stream *aio_stream_open(int fd, size_t offset, size_t len, size_t chunk, int depth, int flags)
+{
+	struct aio_stream *s = NULL;
+	int i = 0, fl = 0;
+
+	errno = 0;
+	if (fd < 0 || chunk == 0 || depth <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((fl = fcntl(fd, F_GETFL)) < 0)
+		return NULL;
+
+	/* O_DIRECT wants aligned offsets, lengths and buffers */
+	if (fl & O_DIRECT) {
+		if (offset % STREAM_ALIGN) {
+			errno = EINVAL;
+			return NULL;
+		}
+		chunk = (chunk + STREAM_ALIGN - 1) & ~((size_t)STREAM_ALIGN - 1);
+	}
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+	s->fd = fd;
+	s->flags = flags;
+	s->direct = !!(fl & O_DIRECT);
+	s->hole = (flags & AIO_STREAM_SPARSE) ? 0 : SIZE_MAX;
+	s->next = offset;
+	s->end = len ? offset + len : SIZE_MAX;
+	s->chunk = chunk;
+	s->max_depth = s->depth = depth;
+	s->dir = -1;
+
+	s->slots = calloc(depth, sizeof(struct __slot));
+	s->fifo = calloc(depth, sizeof(int));
+	s->free = calloc(depth, sizeof(int));
+	if (!s->slots || !s->fifo || !s->free ||
+	    posix_memalign((void **)&s->pool, STREAM_ALIGN, depth*chunk) != 0) {
+		free(s->slots);
+		free(s->fifo);
+		free(s->free);
+		free(s);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* hand out low slots first */
+	for (i = 0; i < depth; ++i) {
+		s->slots[i].buf = s->pool + i*chunk;
+		s->free[depth - i - 1] = i;
+	}
+	s->nfree = depth;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->t0);
+
+	if (refill(s) < 0) {
+		aio_stream_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+
+ssize_t aio_stream_next(struct aio_stream *s, void **buf, size_t *offset)
+{
+	struct __slot *sl = NULL;
+	int idx = 0;
+	long int r = 0;
+
+	errno = 0;
+	if (!s || !buf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (;;) {
+		if (refill(s) < 0 && s->count == 0)
+			return -1;
+		if (s->count == 0)
+			return 0;
+
+		idx = s->fifo[s->head];
+		sl = &s->slots[idx];
+
+		/* Short reads are completed into the same buffer so that
+		 * chunks stay contiguous. A read returning nothing is EOF.
+		 */
+		for (;;) {
+			if ((r = wait_slot(sl)) < 0)
+				break;
+			sl->got += r;
+			if (r == 0 || sl->got == sl->len)
+				break;
+			if (submit_slot(s, sl) < 0) {
+				r = -1;
+				break;
+			}
+		}
+
+		s->head = (s->head + 1) % s->max_depth;
+		--s->count;
+
+		if (r < 0) {
+			sl->state = SLOT_FREE;
+			s->free[s->nfree++] = idx;
+			return -1;
+		}
+
+		if (sl->got < sl->len && !s->eof) {
+			s->eof = 1;
+			s->end = sl->off + sl->got;
+		}
+
+		/* Reads that were already in flight behind the end, or
+		 * zero blocks in sparse mode.
+		 */
+		if (sl->got == 0 ||
+		    ((s->flags & AIO_STREAM_SPARSE) && aio_iszero(sl->buf, sl->got))) {
+			sl->state = SLOT_FREE;
+			s->free[s->nfree++] = idx;
+			continue;
+		}
+		break;
+	}
+
+	sl->state = SLOT_HANDED;
+	*buf = sl->buf;
+	if (offset)
+		*offset = sl->off;
+
+	s->bytes += sl->got;
+	if (++s->delivered == STREAM_WINDOW)
+		adapt(s);
+
+	/* keep the pipeline full while the consumer works on this chunk */
+	refill(s);
+	return sl->got;
+}
+
+
+int aio_stream_release(struct aio_stream *s, void *buf)
+{
+	size_t idx = 0;
+
+	errno = 0;
+	if (!s || (char *)buf < s->pool) {
+		errno = EINVAL;
+		return -1;
+	}
+	idx = ((char *)buf - s->pool)/s->chunk;
+	if (idx >= (size_t)s->max_depth || s->slots[idx].buf != buf ||
+	    s->slots[idx].state != SLOT_HANDED) {
+		errno = EINVAL;
+		return -1;
+	}
+	s->slots[idx].state = SLOT_FREE;
+	s->free[s->nfree++] = idx;
+	refill(s);
+	return 0;
+}
+
+
+int aio_stream_depth(const struct aio_stream *s)
+{
+	return s ? s->depth : -1;
+}
+
+
+void aio_stream_close(struct aio_stream *s)
+{
+	struct __slot *sl = NULL;
+
+	if (!s)
+		return;
+
+	/* The kernel may still DMA into the pool, so everything we could
+	 * not cancel has to be waited for before freeing it. Cancelled
+	 * requests finish right away.
+	 */
+	for (; s->count > 0; --s->count) {
+		sl = &s->slots[s->fifo[s->head]];
+		aio_cancel(s->fd, &sl->cb);
+		wait_slot(sl);
+		s->head = (s->head + 1) % s->max_depth;
+	}
+	free(s->pool);
+	free(s->slots);
+	free(s->fifo);
+	free(s->free);
+	free(s);
+}
+
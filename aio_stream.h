@@ -0,0 +1,48 @@
+/* Sequential streaming reader on top of aio_read(). Keeps a number of
+ * aligned chunks in flight ahead of the consumer and hands out the filled
+ * buffers in file order without copying them.
+ *
+ * (C) 2011 Sebastian Krahmer
+ *
+ * You may use this under the terms of the GPL.
+ */
+#ifndef __aio_stream_h__
+#define __aio_stream_h__
+
+#include "aio.h"
+
+struct aio_stream;
+
+enum {
+	/* Only read data extents (SEEK_DATA/SEEK_HOLE) and skip chunks that
+	 * read as all zeros. Offsets not handed out are zero.
+	 */
+	AIO_STREAM_SPARSE	= 1
+};
+
+/* Open a stream reading 'len' bytes of 'fd' starting at 'offset'. If 'len'
+ * is 0, read until EOF (e.g. end of device). 'chunk' is the size of each
+ * read, rounded up to the disk alignment if 'fd' was opened with O_DIRECT.
+ * At most 'depth' reads are kept in flight; the actual depth adapts to the
+ * observed throughput. 'flags' is a set of AIO_STREAM_*.
+ */
+struct aio_stream *aio_stream_open(int fd, size_t offset, size_t len, size_t chunk, int depth, int flags);
+
+/* Fetch the next chunk in order. Returns its length and stores the buffer
+ * (and optionally its file offset) which stays valid until it is passed to
+ * aio_stream_release(). Returns 0 at end of stream and -1 on error.
+ * In sparse mode, chunks are not contiguous; use the offset.
+ */
+ssize_t aio_stream_next(struct aio_stream *s, void **buf, size_t *offset);
+
+/* Give a buffer obtained by aio_stream_next() back for reuse */
+int aio_stream_release(struct aio_stream *s, void *buf);
+
+/* Current number of reads the stream is keeping in flight */
+int aio_stream_depth(const struct aio_stream *s);
+
+/* Cancels or waits for outstanding reads and frees all buffers */
+void aio_stream_close(struct aio_stream *s);
+
+#endif
+
@@ -0,0 +1,59 @@
+/* aio_copy() throughput, to be compared with dd; see bench_copy.sh */
+#define _GNU_SOURCE
+#include "../aio_copy.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int main(int argc, char **argv)
+{
+	int in, out;
+	ssize_t r = 0;
+	double secs = 0;
+	struct timespec t0, t1;
+	struct aio_copy_opt opt = {1024*1024, 8, AIO_COPY_NOOFFLOAD, NULL, NULL};
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <src> <dst> [chunk] [depth] [offload]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		opt.chunk = strtoul(argv[3], NULL, 0);
+	if (argc > 4)
+		opt.depth = atoi(argv[4]);
+	if (argc > 5)
+		opt.flags = 0;
+
+	if ((in = open(argv[1], O_RDONLY|O_DIRECT)) < 0)
+		die("open src");
+	if ((out = open(argv[2], O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0600)) < 0)
+		die("open dst");
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if ((r = aio_copy(in, 0, out, 0, 0, &opt)) < 0)
+		die("aio_copy");
+	fsync(out);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+	printf("aio_copy: %zd bytes in %.3f s, %.1f MB/s (chunk %zu, depth %d)\n",
+	       r, secs, r/secs/1e6, opt.chunk, opt.depth);
+	close(in);
+	close(out);
+	return 0;
+}
+
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Compare aio_copy() against dd with O_DIRECT on both sides.
+# Usage: bench_copy.sh <src> <dst> [chunk] [depth]
+
+SRC=$1
+DST=$2
+CHUNK=${3:-1048576}
+DEPTH=${4:-8}
+
+if [ -z "$SRC" -o -z "$DST" ]; then
+	echo "Usage: $0 <src> <dst> [chunk] [depth]"
+	exit 1
+fi
+
+echo "dd iflag=direct oflag=direct bs=$CHUNK:"
+dd if="$SRC" of="$DST" bs=$CHUNK iflag=direct oflag=direct conv=fsync 2>&1 | tail -n 1
+rm -f "$DST"
+
+"$(dirname "$0")"/bench_copy "$SRC" "$DST" $CHUNK $DEPTH
+cmp "$SRC" "$DST" && echo "contents match"
+rm -f "$DST"
@@ -0,0 +1,244 @@
+/* Reading a tree of many small files: a plain open/fstat/read/close loop,
+ * aio_read() per file, and aio_files on the worker pool and on io_uring.
+ * Usage: bench_files [files] [depth] [dir]. The tree is generated below
+ * 'dir' (default /tmp) and removed afterwards. Runs on a warm page cache;
+ * drop the caches in between for cold numbers.
+ */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include "../aio_files.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	PER_DIR = 1000,
+	MAX_SIZE = 8192,
+	BATCH = 256
+};
+
+
+static int nfiles = 100000, depth = 64, root = -1;
+static char (*paths)[16] = NULL;
+static char *bufs = NULL;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+void make_tree(void)
+{
+	char data[MAX_SIZE];
+	int i = 0, fd = -1;
+
+	memset(data, 'x', sizeof(data));
+	for (i = 0; i < nfiles; ++i) {
+		if (i % PER_DIR == 0) {
+			snprintf(paths[i], sizeof(paths[i]), "d%d", i/PER_DIR);
+			if (mkdirat(root, paths[i], 0700) < 0)
+				die("mkdirat");
+		}
+		snprintf(paths[i], sizeof(paths[i]), "d%d/f%d", i/PER_DIR, i % PER_DIR);
+		if ((fd = openat(root, paths[i], O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0)
+			die("openat");
+		write(fd, data, (i*7919) % MAX_SIZE);
+		close(fd);
+	}
+}
+
+
+void remove_tree(void)
+{
+	char d[16];
+	int i = 0;
+
+	for (i = 0; i < nfiles; ++i) {
+		unlinkat(root, paths[i], 0);
+		if (i % PER_DIR == PER_DIR - 1 || i == nfiles - 1) {
+			snprintf(d, sizeof(d), "d%d", i/PER_DIR);
+			unlinkat(root, d, AT_REMOVEDIR);
+		}
+	}
+}
+
+
+long long plain(void)
+{
+	struct stat st;
+	long long total = 0;
+	ssize_t r = 0;
+	int i = 0, fd = -1;
+
+	for (i = 0; i < nfiles; ++i) {
+		if ((fd = openat(root, paths[i], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+			die("open");
+		if ((r = read(fd, bufs, MAX_SIZE)) < 0)
+			die("read");
+		total += r;
+		close(fd);
+	}
+	return total;
+}
+
+
+/* open() and fstat() blocking, up to 'depth' aio_read()s in flight */
+long long per_file_aio(void)
+{
+	struct aiocb *cbs = calloc(depth, sizeof(struct aiocb));
+	const struct aiocb **cbl = calloc(depth, sizeof(struct aiocb *));
+	struct stat st;
+	long long total = 0;
+	int i = 0, j = 0, busy = 0, fd = -1;
+
+	while (i < nfiles || busy > 0) {
+		for (j = 0; j < depth && i < nfiles; ++j) {
+			if (cbl[j])
+				continue;
+			if ((fd = openat(root, paths[i], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+				die("open");
+			memset(&cbs[j], 0, sizeof(cbs[j]));
+			cbs[j].aio_fildes = fd;
+			cbs[j].aio_buf = bufs + j*MAX_SIZE;
+			cbs[j].aio_nbytes = MAX_SIZE;
+			if (aio_read(&cbs[j]) < 0)
+				die("aio_read");
+			cbl[j] = &cbs[j];
+			++busy;
+			++i;
+		}
+		aio_suspend(cbl, depth, NULL);
+		for (j = 0; j < depth; ++j) {
+			if (!cbl[j] || aio_error(&cbs[j]) == EINPROGRESS)
+				continue;
+			total += aio_return(&cbs[j]);
+			close(cbs[j].aio_fildes);
+			cbl[j] = NULL;
+			--busy;
+		}
+	}
+	free(cbs);
+	free(cbl);
+	return total;
+}
+
+
+long long files(int flags, int *uring)
+{
+	struct aio_file *fs = calloc(nfiles, sizeof(struct aio_file)), *list[BATCH], *done[BATCH];
+	struct aio_files *q = NULL;
+	long long total = 0;
+	int i = 0, j = 0, n = 0, reaped = 0;
+
+	if ((q = aio_files_open(depth, flags)) == NULL)
+		die("aio_files_open");
+	*uring = aio_files_uring(q);
+
+	/* the buffers of the files in flight are recycled by the slot they
+	 * are handed out from; their contents are not looked at
+	 */
+	for (i = 0; i < nfiles; ++i) {
+		fs[i].dirfd = root;
+		fs[i].path = paths[i];
+		fs[i].buf = bufs + (i % (depth + BATCH))*MAX_SIZE;
+		fs[i].len = MAX_SIZE;
+	}
+	for (i = 0; reaped < nfiles;) {
+		for (n = 0; n < BATCH && i < nfiles && aio_files_pending(q) + n < depth + BATCH; ++n)
+			list[n] = &fs[i++];
+		if (aio_files_submit(q, list, n) < 0)
+			die("aio_files_submit");
+		if ((n = aio_files_reap(q, done, BATCH, NULL)) < 0)
+			die("aio_files_reap");
+		for (j = 0; j < n; ++j) {
+			if (done[j]->error) {
+				errno = done[j]->error;
+				die(done[j]->path);
+			}
+			total += done[j]->nread;
+		}
+		reaped += n;
+	}
+	aio_files_close(q);
+	free(fs);
+	return total;
+}
+
+
+void report(const char *what, double t, long long bytes)
+{
+	printf("%-28s %8.0f files/s %8.1f MB/s\n", what, nfiles/t, bytes/t/(1024*1024));
+}
+
+
+int main(int argc, char **argv)
+{
+	char dir[4096];
+	double t = 0;
+	long long bytes = 0;
+	int uring = 0;
+
+	if (argc > 1)
+		nfiles = atoi(argv[1]);
+	if (argc > 2)
+		depth = atoi(argv[2]);
+	snprintf(dir, sizeof(dir), "%s/aio_files_bench.XXXXXX", argc > 3 ? argv[3] : "/tmp");
+	if (nfiles <= 0 || depth <= 0) {
+		printf("Usage: %s [files] [depth] [dir]\n", argv[0]);
+		return 1;
+	}
+
+	paths = calloc(nfiles, sizeof(*paths));
+	bufs = malloc((size_t)(depth + BATCH)*MAX_SIZE);
+	if (!mkdtemp(dir) || (root = open(dir, O_RDONLY|O_DIRECTORY)) < 0)
+		die(dir);
+	t = now();
+	make_tree();
+	printf("created %d files in %s in %.1fs, depth %d\n", nfiles, dir, now() - t, depth);
+
+	plain();
+	t = now();
+	bytes = plain();
+	report("open/fstat/read/close", now() - t, bytes);
+
+	t = now();
+	bytes = per_file_aio();
+	report("aio_read() per file", now() - t, bytes);
+
+	t = now();
+	bytes = files(AIO_FILES_POOL, &uring);
+	report("aio_files, worker pool", now() - t, bytes);
+
+	t = now();
+	bytes = files(0, &uring);
+	if (uring)
+		report("aio_files, io_uring", now() - t, bytes);
+	else
+		printf("aio_files, io_uring:         not supported here\n");
+
+	remove_tree();
+	close(root);
+	rmdir(dir);
+	free(paths);
+	free(bufs);
+	return 0;
+}
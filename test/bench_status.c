@@ -0,0 +1,125 @@
+/* Cost of the status calls and of a request round trip, single threaded and
+ * with threads hammering their own requests. For before/after comparisons
+ * of changes to the locking and atomics in aio.c.
+ */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	STATUS_CALLS = 10000000,
+	ROUND_TRIPS = 200000,
+	THREADS = 4
+};
+
+
+static int fd = -1;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+/* aio_read() + aio_suspend() + aio_error() + aio_return() of 16 cached bytes */
+void *round_trips(void *vp)
+{
+	struct aiocb a;
+	const struct aiocb *cbl[1] = {&a};
+	char buf[16];
+	int i = 0;
+
+	for (i = 0; i < ROUND_TRIPS; ++i) {
+		memset(&a, 0, sizeof(a));
+		a.aio_fildes = fd;
+		a.aio_buf = buf;
+		a.aio_nbytes = sizeof(buf);
+		a.aio_offset = (i % 64)*sizeof(buf);
+		if (aio_read(&a) < 0)
+			die("aio_read");
+		while (aio_error(&a) == EINPROGRESS)
+			aio_suspend(cbl, 1, NULL);
+		if (aio_return(&a) != sizeof(buf))
+			die("aio_return");
+	}
+	return NULL;
+}
+
+
+int main()
+{
+	char tmpl[] = "/tmp/aio_bench.XXXXXX", buf[1024];
+	const struct aiocb *cbl[1];
+	struct aiocb a;
+	pthread_t tids[THREADS];
+	double t = 0;
+	long sum = 0;
+	int i = 0;
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	memset(buf, 'B', sizeof(buf));
+	pwrite(fd, buf, sizeof(buf), 0);
+
+	memset(&a, 0, sizeof(a));
+	a.aio_fildes = fd;
+	a.aio_buf = buf;
+	a.aio_nbytes = 16;
+	if (aio_read(&a) < 0)
+		die("aio_read");
+	cbl[0] = &a;
+	while (aio_error(&a) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+
+	t = now();
+	for (i = 0; i < STATUS_CALLS; ++i)
+		sum += aio_error(&a);
+	t = now() - t;
+	printf("aio_error():      %6.1f ns/call\n", t*1e9/STATUS_CALLS);
+
+	t = now();
+	for (i = 0; i < STATUS_CALLS; ++i)
+		sum += aio_error_fast(&a);
+	t = now() - t;
+	printf("aio_error_fast(): %6.1f ns/call\n", t*1e9/STATUS_CALLS);
+	aio_return(&a);
+
+	t = now();
+	round_trips(NULL);
+	t = now() - t;
+	printf("round trip:       %6.1f us, 1 thread\n", t*1e6/ROUND_TRIPS);
+
+	t = now();
+	for (i = 0; i < THREADS; ++i)
+		pthread_create(&tids[i], NULL, round_trips, NULL);
+	for (i = 0; i < THREADS; ++i)
+		pthread_join(tids[i], NULL);
+	t = now() - t;
+	printf("round trip:       %6.1f us, %d threads (%.0f/s)\n", t*1e6/ROUND_TRIPS, THREADS,
+	       THREADS*ROUND_TRIPS/t);
+
+	close(fd);
+	return sum == 0 ? 0 : 1;
+}
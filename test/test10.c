@@ -0,0 +1,143 @@
+/* test module for aio implementation for aio_cancel(fd, NULL) across threads */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	THREADS = 4,
+	PER_THREAD = 8,
+	BIG_CHUNK = 1024*1024
+};
+
+
+struct submitter {
+	pthread_t t;
+	int idx, fd, cancelled, done, bad;
+	char *buf;
+	struct aiocb a[PER_THREAD];
+};
+
+static pthread_barrier_t after_submit, after_cancel;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+void *submit(void *vp)
+{
+	struct submitter *s = vp;
+	const struct aiocb *cbl[1];
+	int i = 0, e = 0, off = 0;
+
+	for (i = 0; i < PER_THREAD; ++i) {
+		off = (s->idx*PER_THREAD + i)*BIG_CHUNK;
+		s->a[i].aio_fildes = s->fd;
+		s->a[i].aio_buf = s->buf + off;
+		s->a[i].aio_nbytes = BIG_CHUNK;
+		s->a[i].aio_offset = off;
+		if (aio_read(&s->a[i]) < 0)
+			die("aio_read");
+	}
+	pthread_barrier_wait(&after_submit);
+	pthread_barrier_wait(&after_cancel);
+
+	for (i = 0; i < PER_THREAD; ++i) {
+		cbl[0] = &s->a[i];
+		while ((e = aio_error(&s->a[i])) == EINPROGRESS)
+			aio_suspend(cbl, 1, NULL);
+		if (e == ECANCELED && aio_return(&s->a[i]) == -1)
+			++s->cancelled;
+		else if (e == 0 && aio_return(&s->a[i]) == BIG_CHUNK)
+			++s->done;
+		else
+			++s->bad;
+	}
+	return NULL;
+}
+
+
+int main()
+{
+	int fd, i = 0, e = 0, ok = 1, cancelled = 0, done = 0;
+	char tmpl[] = "/tmp/aio_cancel.XXXXXX", *buf = NULL;
+	struct submitter s[THREADS];
+	struct aio_sched_stats st;
+	size_t size = THREADS*PER_THREAD*BIG_CHUNK;
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	if (posix_memalign((void **)&buf, 4096, size) != 0)
+		die("posix_memalign");
+	memset(buf, 'A', size);
+	pwrite(fd, buf, size, 0);
+	fsync(fd);
+
+	/* Nothing submitted on a valid fd is not an error, an invalid fd is */
+	e = aio_cancel(fd, NULL);
+	ok &= e == AIO_ALLDONE;
+	printf("cancel without requests: %s\n", e == AIO_ALLDONE ? "ok" : "FAILED");
+	e = aio_cancel(7350, NULL);
+	ok &= e == -1 && errno == EBADF;
+	printf("cancel invalid fd: %s\n", e == -1 && errno == EBADF ? "ok" : "FAILED");
+	close(fd);
+
+	/* tmpfs does not do O_DIRECT. Uncached reads thru one slot, so most
+	 * requests of each thread are still queued when they are cancelled.
+	 */
+	if ((fd = open(tmpl, O_RDONLY|O_DIRECT)) < 0 && (fd = open(tmpl, O_RDONLY)) < 0)
+		die("open");
+	unlink(tmpl);
+	aio_sched_limit(fd, 1);
+
+	pthread_barrier_init(&after_submit, NULL, THREADS + 1);
+	pthread_barrier_init(&after_cancel, NULL, THREADS + 1);
+	memset(s, 0, sizeof(s));
+	for (i = 0; i < THREADS; ++i) {
+		s[i].idx = i;
+		s[i].fd = fd;
+		s[i].buf = buf;
+		if (pthread_create(&s[i].t, NULL, submit, &s[i]) != 0)
+			die("pthread_create");
+	}
+
+	/* From a thread which did not submit anything */
+	pthread_barrier_wait(&after_submit);
+	e = aio_cancel(fd, NULL);
+	aio_sched_stats(fd, &st);
+	printf("cancel: %s, %d queued afterwards\n", e == AIO_CANCELED ? "AIO_CANCELED" :
+	       (e == AIO_ALLDONE ? "AIO_ALLDONE" : "AIO_NOTCANCELED"), st.queued);
+	ok &= e != -1 && st.queued == 0;
+	pthread_barrier_wait(&after_cancel);
+
+	for (i = 0; i < THREADS; ++i) {
+		pthread_join(s[i].t, NULL);
+		printf("thread %d: %d cancelled, %d finished\n", i, s[i].cancelled, s[i].done);
+		ok &= s[i].bad == 0 && s[i].cancelled > 0;
+		cancelled += s[i].cancelled;
+		done += s[i].done;
+	}
+	e = cancelled + done == THREADS*PER_THREAD;
+	ok &= e;
+	printf("cancel across threads: %s\n", ok ? "ok" : "FAILED");
+
+	aio_sched_stats(fd, &st);
+	ok &= st.inflight == 0 && st.queued == 0;
+	aio_sched_limit(fd, 0);
+	close(fd);
+	free(buf);
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,163 @@
+/* test module for aio implementation for lio_listio() list notification */
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+enum { CHUNK = 4 };
+
+static volatile sig_atomic_t signals = 0;
+static int threads = 0;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+void sig_usr1(int x)
+{
+	++signals;
+}
+
+
+void thread_cb(union sigval v)
+{
+	__atomic_add_fetch(&threads, v.sival_int, __ATOMIC_RELEASE);
+}
+
+
+void setup(struct aiocb *a, struct aiocb **list, int n, int fd, char *buf)
+{
+	int i = 0;
+
+	memset(a, 0, n*sizeof(*a));
+	for (i = 0; i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		a[i].aio_lio_opcode = LIO_READ;
+		list[i] = &a[i];
+	}
+}
+
+
+int main()
+{
+	int fd, i = 0, n = 0, e = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL, **list = NULL;
+	struct sigaction sa;
+	struct sigevent sev;
+	const struct aiocb *cbl[1];
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	n = (st.st_size + CHUNK - 1)/CHUNK;
+	a = calloc(n, sizeof(struct aiocb));
+	list = calloc(n, sizeof(struct aiocb *));
+	buf = calloc(1, st.st_size);
+	ref = calloc(1, st.st_size);
+	pread(fd, ref, st.st_size, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_usr1;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* LIO_WAIT returns with all members done */
+	setup(a, list, n, fd, buf);
+	list[n/2]->aio_lio_opcode = LIO_NOP;
+	if (lio_listio(LIO_WAIT, list, n, NULL) < 0)
+		die("lio_listio");
+	for (i = 0; i < n; ++i) {
+		if (i != n/2 && (aio_error(&a[i]) != 0 || aio_return(&a[i]) <= 0))
+			ok = 0;
+	}
+	e = ok && memcmp(buf, ref, (n/2)*CHUNK) == 0;
+	ok &= e;
+	printf("LIO_WAIT: %d members: %s\n", n, e ? "ok" : "FAILED");
+
+	/* LIO_NOWAIT sends one signal for the list, not one per member */
+	memset(buf, 0, st.st_size);
+	setup(a, list, n, fd, buf);
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGUSR1;
+	if (lio_listio(LIO_NOWAIT, list, n, &sev) < 0)
+		die("lio_listio");
+	for (i = 0; i < n; ++i) {
+		cbl[0] = &a[i];
+		while (aio_error(&a[i]) == EINPROGRESS)
+			aio_suspend(cbl, 1, NULL);
+		aio_return(&a[i]);
+	}
+	for (i = 0; i < 100 && signals == 0; ++i)
+		usleep(1000);
+	usleep(10000);
+	e = signals == 1 && memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("LIO_NOWAIT: %d signal(s) for %d members: %s\n", (int)signals, n, e ? "ok" : "FAILED");
+
+	/* SIGEV_THREAD runs the callback once for the list, once for a request */
+	memset(buf, 0, st.st_size);
+	setup(a, list, n, fd, buf);
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = thread_cb;
+	sev.sigev_value.sival_int = 1;
+	a[0].aio_sigevent = sev;
+	a[0].aio_sigevent.sigev_value.sival_int = 100;
+	if (lio_listio(LIO_NOWAIT, list, n, &sev) < 0)
+		die("lio_listio");
+	for (i = 0; i < 1000 && __atomic_load_n(&threads, __ATOMIC_ACQUIRE) != 101; ++i)
+		usleep(1000);
+	usleep(10000);
+	for (i = 0; i < n; ++i)
+		aio_return(&a[i]);
+	e = __atomic_load_n(&threads, __ATOMIC_ACQUIRE) == 101 && memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("SIGEV_THREAD: %s\n", e ? "ok" : "FAILED");
+
+	/* Notifications that can not be delivered are refused */
+	setup(a, list, 1, fd, buf);
+	sev.sigev_notify_function = NULL;
+	e = lio_listio(LIO_NOWAIT, list, 1, &sev) == -1 && errno == EINVAL;
+	a[0].aio_sigevent.sigev_notify = -1;
+	e = e && aio_read(&a[0]) == -1 && errno == EINVAL;
+	ok &= e;
+	printf("bad sigevent: %s\n", e ? "EINVAL" : "FAILED");
+
+	/* A failing member fails the waiting list with EIO */
+	setup(a, list, 2, fd, buf);
+	list[1]->aio_lio_opcode = LIO_WRITE;
+	e = lio_listio(LIO_WAIT, list, 2, NULL) == -1 && errno == EIO;
+	aio_return(&a[0]);
+	aio_return(&a[1]);
+	ok &= e;
+	printf("LIO_WAIT with failed member: %s\n", e ? "EIO" : "FAILED");
+
+	free(a);
+	free(list);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,149 @@
+/* test module for aio implementation for aio_rate_limit() */
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	CHUNK = 64*1024,
+	CHUNKS = 16,
+	SMALL_CHUNKS = 30
+};
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+/* Submit 'n' reads of 'len' bytes and wait for all of them. Returns the
+ * seconds it took, and in *submit how long the submission took.
+ */
+double run(int fd, struct aiocb *a, int n, size_t len, char *buf, double *submit)
+{
+	const struct aiocb *cbl[1];
+	double start = now();
+	int i = 0;
+
+	for (i = 0; i < n; ++i) {
+		memset(&a[i], 0, sizeof(a[i]));
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*len;
+		a[i].aio_nbytes = len;
+		a[i].aio_offset = i*len;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	*submit = now() - start;
+	for (i = 0; i < n; ++i) {
+		cbl[0] = &a[i];
+		while (aio_error(&a[i]) == EINPROGRESS)
+			aio_suspend(cbl, 1, NULL);
+		if (aio_return(&a[i]) != (long int)len)
+			die("aio_return");
+	}
+	return now() - start;
+}
+
+
+int main()
+{
+	int fd, e = 0, ok = 1;
+	char tmpl[] = "/tmp/aio_rate.XXXXXX", *buf = NULL, *ref = NULL;
+	struct aiocb a[SMALL_CHUNKS];
+	const struct aiocb *cbl[1];
+	struct aio_rate rate;
+	double t = 0, submit = 0;
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	buf = calloc(1, CHUNK*CHUNKS);
+	ref = malloc(CHUNK*CHUNKS);
+	memset(ref, 'R', CHUNK*CHUNKS);
+	pwrite(fd, ref, CHUNK*CHUNKS, 0);
+
+	/* 4MB/s with a 256K burst: 1MB takes about 0.19s */
+	memset(&rate, 0, sizeof(rate));
+	rate.bytes = 4*1024*1024;
+	rate.burst_bytes = 256*1024;
+	if (aio_rate_limit(1, &rate) < 0 || aio_rate_tag(fd, 1) != -1)
+		die("aio_rate_limit");
+	t = run(fd, a, CHUNKS, CHUNK, buf, &submit);
+	e = t > 0.15 && t < 2 && submit < 0.05 && memcmp(buf, ref, CHUNK*CHUNKS) == 0;
+	ok &= e;
+	printf("bytes: 1MB in %.3fs, submitted in %.3fs: %s\n", t, submit, e ? "ok" : "FAILED");
+
+	/* 100 requests/s with a burst of 10: 30 requests take about 0.2s */
+	memset(&rate, 0, sizeof(rate));
+	rate.ops = 100;
+	rate.burst_ops = 10;
+	if (aio_rate_limit(1, &rate) < 0)
+		die("aio_rate_limit");
+	t = run(fd, a, SMALL_CHUNKS, 16, buf, &submit);
+	e = t > 0.15 && t < 2 && submit < 0.05;
+	ok &= e;
+	printf("ops: %d requests in %.3fs, submitted in %.3fs: %s\n", SMALL_CHUNKS, t, submit, e ? "ok" : "FAILED");
+
+	/* 1MB/s with a 64K burst and an empty bucket: a small read behind a
+	 * full burst one waits for it, about 64ms, instead of slipping thru
+	 */
+	memset(&rate, 0, sizeof(rate));
+	rate.bytes = 1024*1024;
+	rate.burst_bytes = CHUNK;
+	if (aio_rate_limit(1, &rate) < 0)
+		die("aio_rate_limit");
+	run(fd, a, 1, CHUNK, buf, &submit);
+	t = now();
+	memset(a, 0, 2*sizeof(a[0]));
+	a[0].aio_fildes = a[1].aio_fildes = fd;
+	a[0].aio_buf = buf;
+	a[0].aio_nbytes = CHUNK;
+	a[1].aio_buf = buf + CHUNK;
+	a[1].aio_nbytes = 16;
+	if (aio_read(&a[0]) < 0 || aio_read(&a[1]) < 0)
+		die("aio_read");
+	cbl[0] = &a[1];
+	while (aio_error(&a[1]) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	t = now() - t;
+	cbl[0] = &a[0];
+	while (aio_error(&a[0]) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	e = t > 0.04 && aio_return(&a[0]) == CHUNK && aio_return(&a[1]) == 16;
+	ok &= e;
+	printf("small behind large: waited %.3fs: %s\n", t, e ? "ok" : "FAILED");
+
+	/* Untagged it is not throttled anymore */
+	if (aio_rate_tag(fd, -1) != 1)
+		ok = 0;
+	t = run(fd, a, SMALL_CHUNKS, 16, buf, &submit);
+	e = t < 0.1;
+	ok &= e;
+	printf("untagged: %d requests in %.3fs: %s\n", SMALL_CHUNKS, t, e ? "ok" : "FAILED");
+
+	aio_rate_limit(1, NULL);
+	close(fd);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+
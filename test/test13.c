@@ -0,0 +1,129 @@
+/* test module for aio implementation for libaio-posix.so: built against
+ * glibc's <aio.h> and -lrt, run with LD_PRELOAD=./libaio-posix.so (which it
+ * does on its own if not given).
+ */
+#define _GNU_SOURCE
+#define _LARGEFILE64_SOURCE
+#include <aio.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum { CHUNK = 16 };
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int wait_for(struct aiocb *a)
+{
+	const struct aiocb *cbl[1] = {a};
+	int e = 0;
+
+	while ((e = aio_error(a)) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	return e;
+}
+
+
+int main(int argc, char **argv)
+{
+	int fd, i = 0, n = 0, e = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL, **list = NULL;
+	struct aiocb64 a64;
+	int (*stats)(int, void *) = NULL;
+	int st_buf[2];
+
+	/* glibc's own AIO runs threads; make sure it is us */
+	if ((stats = (int (*)(int, void *))dlsym(RTLD_DEFAULT, "aio_sched_stats")) == NULL) {
+		if (getenv("LD_PRELOAD"))
+			die("libaio-posix.so not preloaded");
+		setenv("LD_PRELOAD", "./libaio-posix.so", 1);
+		execv("/proc/self/exe", argv);
+		die("execv");
+	}
+	printf("preloaded: ok\n");
+
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+		die("open");
+	fstat(fd, &st);
+
+	n = (st.st_size + CHUNK - 1)/CHUNK;
+	a = calloc(n, sizeof(struct aiocb));
+	list = calloc(n, sizeof(struct aiocb *));
+	buf = calloc(1, st.st_size);
+	ref = calloc(1, st.st_size);
+	pread(fd, ref, st.st_size, 0);
+
+	for (i = 0; i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	for (i = 0; i < n; ++i) {
+		if (wait_for(&a[i]) != 0 || aio_return(&a[i]) <= 0)
+			ok = 0;
+	}
+	stats(fd, st_buf);
+	e = ok && st_buf[0] == 0 && memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("aio_read: %d chunks: %s\n", n, e ? "ok" : "FAILED");
+
+	memset(buf, 0, st.st_size);
+	memset(&a64, 0, sizeof(a64));
+	a64.aio_fildes = fd;
+	a64.aio_buf = buf;
+	a64.aio_nbytes = CHUNK;
+	if (aio_read64(&a64) < 0)
+		die("aio_read64");
+	while ((e = aio_error64(&a64)) == EINPROGRESS)
+		usleep(1000);
+	e = e == 0 && aio_return64(&a64) == CHUNK && memcmp(buf, ref, CHUNK) == 0;
+	ok &= e;
+	printf("aio_read64: %s\n", e ? "ok" : "FAILED");
+
+	memset(buf, 0, st.st_size);
+	memset(a, 0, n*sizeof(struct aiocb));
+	for (i = 0; i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		a[i].aio_lio_opcode = LIO_READ;
+		list[i] = &a[i];
+	}
+	if (lio_listio(LIO_WAIT, list, n, NULL) < 0)
+		die("lio_listio");
+	for (i = 0; i < n; ++i)
+		aio_return(&a[i]);
+	e = memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("lio_listio: %s\n", e ? "ok" : "FAILED");
+
+	e = aio_cancel(fd, NULL) == AIO_ALLDONE;
+	ok &= e;
+	printf("aio_cancel: %s\n", e ? "ok" : "FAILED");
+
+	free(a);
+	free(list);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,157 @@
+/* test module for aio implementation for the C++20 layer in aio.hpp */
+#include "../aio.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum { CHUNK = 64, READERS = 8 };
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+static size_t max_waiting = 0;
+
+/* Each reader takes every READERS'th chunk */
+aio::task<void> reader(aio::executor &ex, int fd, char *buf, off_t size, int idx, long *total)
+{
+	long r = 0;
+
+	for (off_t off = idx*CHUNK; off < size; off += READERS*CHUNK) {
+		auto op = ex.read(fd, buf + off, CHUNK, off);
+
+		if (ex.waiting() + 1 > max_waiting)
+			max_waiting = ex.waiting() + 1;
+		if ((r = co_await op) < 0)
+			co_return;
+		*total += r;
+	}
+}
+
+
+aio::task<std::string> write_back(aio::executor &ex, int fd, const std::string &s)
+{
+	std::string in(s.size(), 0);
+	long r = 0;
+
+	if ((r = co_await ex.write(fd, s.data(), s.size(), 0)) != (long)s.size())
+		throw std::runtime_error("write");
+	if (co_await ex.fsync(fd) < 0)
+		throw std::runtime_error("fsync");
+	if ((r = co_await ex.read(fd, in.data(), in.size(), 0)) != (long)s.size())
+		throw std::runtime_error("read");
+	co_return in;
+}
+
+
+aio::task<void> fail(aio::executor &ex)
+{
+	char c = 0;
+
+	if (co_await ex.read(-1, &c, 1, 0) != -EBADF)
+		co_return;
+	throw std::runtime_error("EBADF");
+}
+
+
+/* Waits for something the executor doesn't know about */
+aio::task<int> stuck_int()
+{
+	co_await std::suspend_always{};
+	co_return 1;
+}
+
+
+aio::task<void> stuck_void()
+{
+	co_await std::suspend_always{};
+}
+
+
+int main()
+{
+	int fd, wfd, e = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL, tmpl[] = "/tmp/aio_hpp.XXXXXX";
+	long total = 0;
+	aio::executor ex;
+
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+		die("open");
+	fstat(fd, &st);
+	buf = (char *)calloc(1, st.st_size + CHUNK);
+	ref = (char *)calloc(1, st.st_size + CHUNK);
+	pread(fd, ref, st.st_size, 0);
+
+	/* Many coroutines waiting at once, one thread */
+	for (int i = 0; i < READERS; ++i)
+		ex.spawn(reader(ex, fd, buf, st.st_size, i, &total));
+	ex.run();
+	e = total == st.st_size && memcmp(buf, ref, st.st_size) == 0 && max_waiting == READERS;
+	ok &= e;
+	printf("%d readers: %ld bytes, %zu waiting at most: %s\n", READERS, total, max_waiting, e ? "ok" : "FAILED");
+
+	if ((wfd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	e = ex.run(write_back(ex, wfd, "written thru aio.hpp")) == "written thru aio.hpp";
+	ok &= e;
+	printf("write, fsync, read: %s\n", e ? "ok" : "FAILED");
+	close(wfd);
+
+	/* Errors come back as -errno, exceptions thru run() */
+	e = 0;
+	try {
+		ex.run(fail(ex));
+	} catch (const std::runtime_error &) {
+		e = 1;
+	}
+	ok &= e;
+	printf("exception: %s\n", e ? "ok" : "FAILED");
+
+	/* A task run() can't finish is an error, not a result */
+	e = 0;
+	try {
+		ex.run(stuck_int());
+	} catch (const std::logic_error &) {
+		++e;
+	}
+	try {
+		ex.run(stuck_void());
+	} catch (const std::logic_error &) {
+		++e;
+	}
+	e = e == 2;
+	ok &= e;
+	printf("unfinished task: %s\n", e ? "ok" : "FAILED");
+
+	/* Requests owned without coroutines; the destructor reaps */
+	{
+		aio::request a, b;
+
+		memset(buf, 0, st.st_size);
+		if (a.read(fd, buf, CHUNK, 0) < 0 || b.read(fd, buf + CHUNK, CHUNK, CHUNK) < 0)
+			die("read");
+		e = a.wait() == CHUNK && memcmp(buf, ref, CHUNK) == 0 && !a.busy();
+		aio::request c(std::move(a));
+		ok &= e;
+		printf("request: %s\n", e ? "ok" : "FAILED");
+	}
+
+	free(buf);
+	free(ref);
+	close(fd);
+	return ok ? 0 : 1;
+}
+
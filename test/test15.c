@@ -0,0 +1,183 @@
+/* test module for aio implementation: threads submitting, polling, waiting,
+ * cancelling and timing out requests all at once. Meant to be run under
+ * ThreadSanitizer as well, see 'make tsan'.
+ */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	THREADS = 6,
+	ROUNDS = 300,
+	BATCH = 8,
+	CHUNK = 512,
+	FILE_SIZE = BATCH*CHUNK*4
+};
+
+
+struct worker {
+	pthread_t t;
+	int idx, ok, cancelled, timedout, done;
+};
+
+static int fd = -1;
+static char ref[FILE_SIZE];
+static int stop = 0;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+/* A finished request either read the right bytes or failed in a way the
+ * other threads may have caused.
+ */
+int check(struct worker *w, struct aiocb *a, int e)
+{
+	long int r = aio_return(a);
+
+	if (e == ECANCELED) {
+		++w->cancelled;
+		return r == -1;
+	}
+	if (e == ETIMEDOUT) {
+		++w->timedout;
+		return r == -1;
+	}
+	++w->done;
+	return e == 0 && r == CHUNK && memcmp((char *)a->aio_buf, ref + a->aio_offset, CHUNK) == 0;
+}
+
+
+void *work(void *vp)
+{
+	struct worker *w = vp;
+	struct aiocb a[BATCH];
+	const struct aiocb *cbl[BATCH];
+	struct aiocb *list[BATCH];
+	struct timespec zero = {0, 0};
+	char *buf = malloc(BATCH*CHUNK);
+	int i = 0, j = 0, e = 0, left = 0;
+
+	w->ok = 1;
+	for (i = 0; i < ROUNDS; ++i) {
+		memset(a, 0, sizeof(a));
+		memset(buf, 0, BATCH*CHUNK);
+		for (j = 0; j < BATCH; ++j) {
+			a[j].aio_fildes = fd;
+			a[j].aio_buf = buf + j*CHUNK;
+			a[j].aio_nbytes = CHUNK;
+			a[j].aio_offset = ((i + j + w->idx) % (FILE_SIZE/CHUNK))*CHUNK;
+			a[j].aio_reqprio = (i + j) % 3;
+			a[j].aio_lio_opcode = LIO_READ;
+			cbl[j] = list[j] = &a[j];
+		}
+
+		/* alternate between lio_listio(), plugged and single submits */
+		if (i % 3 == 0) {
+			if (lio_listio(LIO_NOWAIT, list, BATCH, NULL) < 0)
+				die("lio_listio");
+		} else {
+			if (i % 3 == 1)
+				aio_plug();
+			for (j = 0; j < BATCH; ++j) {
+				if (aio_read(&a[j]) < 0)
+					die("aio_read");
+			}
+			if (i % 3 == 1)
+				aio_unplug();
+		}
+		if (i % 5 == 0)
+			aio_deadline(&a[BATCH - 1], &zero);
+
+		/* poll some, wait for the rest */
+		for (left = BATCH; left > 0;) {
+			for (j = 0, left = 0; j < BATCH; ++j) {
+				if (!cbl[j])
+					continue;
+				e = j % 2 ? aio_error_fast(&a[j]) : aio_error(&a[j]);
+				if (e == EINPROGRESS) {
+					++left;
+					continue;
+				}
+				if (!check(w, &a[j], e))
+					w->ok = 0;
+				cbl[j] = NULL;
+			}
+			if (left)
+				aio_suspend(cbl, BATCH, NULL);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/* Cancels whatever is on the fd right now, and looks at the counters */
+void *cancel(void *vp)
+{
+	struct aio_sched_stats st;
+	struct timespec ms = {0, 5000000};
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		if (aio_cancel(fd, NULL) < 0)
+			die("aio_cancel");
+		aio_sched_stats(fd, &st);
+		nanosleep(&ms, NULL);
+	}
+	return NULL;
+}
+
+
+int main()
+{
+	struct worker w[THREADS];
+	pthread_t c;
+	char tmpl[] = "/tmp/aio_stress.XXXXXX";
+	int i = 0, ok = 1, cancelled = 0, timedout = 0, done = 0;
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	for (i = 0; i < FILE_SIZE; ++i)
+		ref[i] = 'a' + i % 26;
+	pwrite(fd, ref, FILE_SIZE, 0);
+
+	/* a small limit, so requests also queue up in the scheduler */
+	aio_sched_limit(fd, 4);
+
+	memset(w, 0, sizeof(w));
+	pthread_create(&c, NULL, cancel, NULL);
+	for (i = 0; i < THREADS; ++i) {
+		w[i].idx = i;
+		pthread_create(&w[i].t, NULL, work, &w[i]);
+	}
+	for (i = 0; i < THREADS; ++i) {
+		pthread_join(w[i].t, NULL);
+		ok &= w[i].ok;
+		cancelled += w[i].cancelled;
+		timedout += w[i].timedout;
+		done += w[i].done;
+	}
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	pthread_join(c, NULL);
+
+	ok &= done + cancelled + timedout == THREADS*ROUNDS*BATCH;
+	printf("%d threads: %d done, %d cancelled, %d timed out: %s\n", THREADS, done, cancelled,
+	       timedout, ok ? "ok" : "FAILED");
+	close(fd);
+	return ok ? 0 : 1;
+}
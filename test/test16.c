@@ -0,0 +1,180 @@
+/* test module for aio implementation for aio_chain() */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	CHUNK = 4096,
+	SHORT = 100
+};
+
+
+static volatile sig_atomic_t signals = 0;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+void count(int sig)
+{
+	++signals;
+}
+
+
+int tmpfile_fd(void)
+{
+	char tmpl[] = "/tmp/aio_chain.XXXXXX";
+	int fd = -1;
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	return fd;
+}
+
+
+/* read 'in' -> write 'out' from the same buffer -> fdatasync 'out' */
+void copy_chain(struct aiocb *a, struct aiocb **list, int in, int out, char *buf)
+{
+	memset(a, 0, 3*sizeof(*a));
+	a[0].aio_fildes = in;
+	a[0].aio_buf = buf;
+	a[0].aio_nbytes = CHUNK;
+	a[0].aio_lio_opcode = LIO_READ;
+	a[1].aio_fildes = out;
+	a[1].aio_buf = buf;
+	a[1].aio_nbytes = CHUNK;
+	a[1].aio_lio_opcode = LIO_WRITE;
+	a[2].aio_fildes = out;
+	a[2].aio_lio_opcode = LIO_FDSYNC;
+	list[0] = &a[0];
+	list[1] = &a[1];
+	list[2] = &a[2];
+}
+
+
+int main()
+{
+	int in, out, bad, e = 0, ok = 1;
+	char *buf = NULL, *ref = NULL, *back = NULL;
+	struct aiocb a[3], one;
+	struct aiocb *list[3];
+	const struct aiocb *cbl[1];
+	struct aio_rate rate;
+	struct sigevent sig;
+	struct timespec ms = {0, 1000000};
+	int i = 0;
+
+	buf = calloc(1, CHUNK);
+	ref = malloc(CHUNK);
+	back = calloc(1, CHUNK);
+	for (i = 0; i < CHUNK; ++i)
+		ref[i] = 'a' + i % 26;
+	in = tmpfile_fd();
+	out = tmpfile_fd();
+	pwrite(in, ref, CHUNK, 0);
+
+	/* A copy, waited for as a whole */
+	copy_chain(a, list, in, out, buf);
+	e = aio_chain(LIO_WAIT, list, 3, NULL) == 0 && aio_return(&a[0]) == CHUNK &&
+	    aio_return(&a[1]) == CHUNK && aio_return(&a[2]) == 0 &&
+	    pread(out, back, CHUNK, 0) == CHUNK && memcmp(back, ref, CHUNK) == 0;
+	ok &= e;
+	printf("read, write, fdatasync: %s\n", e ? "ok" : "FAILED");
+
+	/* The write only writes what the read got; nobody calls in between */
+	ftruncate(in, SHORT);
+	ftruncate(out, 0);
+	copy_chain(a, list, in, out, buf);
+	memset(&sig, 0, sizeof(sig));
+	sig.sigev_notify = SIGEV_SIGNAL;
+	sig.sigev_signo = SIGUSR1;
+	signal(SIGUSR1, count);
+	if (aio_chain(LIO_NOWAIT, list, 3, &sig) < 0)
+		die("aio_chain");
+	for (i = 0; i < 5000 && !signals; ++i)
+		nanosleep(&ms, NULL);
+	e = signals == 1 && aio_error_fast(&a[2]) == 0 && aio_return(&a[0]) == SHORT &&
+	    aio_return(&a[1]) == SHORT && aio_return(&a[2]) == 0 && lseek(out, 0, SEEK_END) == SHORT;
+	ok &= e;
+	printf("short read, one signal: %s\n", e ? "ok" : "FAILED");
+
+	/* A failing step cancels the rest */
+	if ((bad = open("/etc/passwd", O_RDONLY)) < 0)
+		die("open");
+	copy_chain(a, list, in, bad, buf);
+	errno = 0;
+	e = aio_chain(LIO_WAIT, list, 3, NULL) == -1 && errno == EIO &&
+	    aio_error(&a[0]) == 0 && aio_error(&a[1]) == EBADF && aio_error(&a[2]) == ECANCELED;
+	for (i = 0; i < 3; ++i)
+		aio_return(&a[i]);
+	ok &= e;
+	printf("failure: %s\n", e ? "ok" : "FAILED");
+
+	/* A step past the first one with an fd beyond any table takes back the
+	 * whole chain, nothing stays behind
+	 */
+	copy_chain(a, list, in, out, buf);
+	a[1].aio_fildes = INT_MAX - 1;
+	errno = 0;
+	e = aio_chain(LIO_WAIT, list, 3, NULL) == -1 && errno == EBADF &&
+	    aio_error_fast(&a[0]) == EBADF && aio_error_fast(&a[1]) == EBADF;
+	e = e && aio_error(&a[0]) == -1 && errno == EINVAL && aio_error(&a[1]) == -1;
+	ok &= e;
+	printf("bad fd in a later step: %s\n", e ? "ok" : "FAILED");
+
+	/* Steps waiting for their turn stay and can be cancelled. The first one
+	 * is held back by an empty bucket.
+	 */
+	memset(&rate, 0, sizeof(rate));
+	rate.ops = 1;
+	rate.burst_ops = 1;
+	aio_rate_limit(0, &rate);
+	aio_rate_tag(in, 0);
+	memset(&one, 0, sizeof(one));
+	one.aio_fildes = in;
+	one.aio_buf = buf;
+	one.aio_nbytes = 1;
+	if (aio_read(&one) < 0)
+		die("aio_read");
+	cbl[0] = &one;
+	while (aio_error(&one) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	aio_return(&one);
+
+	copy_chain(a, list, in, out, buf);
+	if (aio_chain(LIO_NOWAIT, list, 3, NULL) < 0)
+		die("aio_chain");
+	errno = 0;
+	e = aio_error(&a[1]) == EINPROGRESS && aio_return(&a[1]) == -1 && errno == EINVAL &&
+	    aio_cancel(in, NULL) == AIO_CANCELED && aio_error(&a[0]) == ECANCELED &&
+	    aio_error(&a[1]) == ECANCELED && aio_error(&a[2]) == ECANCELED;
+	for (i = 0; i < 3; ++i)
+		aio_return(&a[i]);
+	ok &= e;
+	printf("cancel: %s\n", e ? "ok" : "FAILED");
+	aio_rate_limit(0, NULL);
+
+	close(in);
+	close(out);
+	close(bad);
+	free(buf);
+	free(ref);
+	free(back);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/* test module for aio implementation for aio_poll() on pipes and sockets */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static volatile sig_atomic_t signals = 0;
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+void count(int sig)
+{
+	++signals;
+}
+
+
+void poll_cb(struct aiocb *a, int fd)
+{
+	memset(a, 0, sizeof(*a));
+	a->aio_fildes = fd;
+}
+
+
+/* Wait until none of the 'n' requests is in progress anymore */
+void wait_all(struct aiocb *a[], int n)
+{
+	const struct aiocb *cbl[4];
+	int i = 0, left = n;
+
+	while (left > 0) {
+		for (i = 0, left = 0; i < n; ++i) {
+			cbl[i] = aio_error(a[i]) == EINPROGRESS ? a[i] : NULL;
+			left += cbl[i] != NULL;
+		}
+		if (left)
+			aio_suspend(cbl, n, NULL);
+	}
+}
+
+
+int main()
+{
+	int p[2], s[2], file, e = 0, ok = 1, i = 0;
+	char tmpl[] = "/tmp/aio_poll.XXXXXX", buf[64];
+	struct aiocb pa, ra, sa, pl[3];
+	struct aiocb *both[2] = {&pa, &ra}, *two[2] = {&pl[0], &pl[1]};
+	struct timespec ms = {0, 1000000}, to = {0, 20000000}, to2 = {0, 5000000};
+
+	if (pipe(p) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, s) < 0)
+		die("pipe");
+	if ((file = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	pwrite(file, "data", 4, 0);
+
+	/* A pipe becoming readable and a file read, waited for together */
+	poll_cb(&pa, p[0]);
+	if (aio_poll(&pa, POLLIN) < 0) {
+		if (errno == EINVAL) {
+			printf("IOCB_CMD_POLL not supported by this kernel, skipped\n");
+			return 0;
+		}
+		die("aio_poll");
+	}
+	memset(&ra, 0, sizeof(ra));
+	ra.aio_fildes = file;
+	ra.aio_buf = buf;
+	ra.aio_nbytes = 4;
+	if (aio_read(&ra) < 0)
+		die("aio_read");
+	nanosleep(&ms, NULL);
+	e = aio_error(&pa) == EINPROGRESS;
+	write(p[1], "x", 1);
+	wait_all(both, 2);
+	e = e && aio_error(&pa) == 0 && (aio_return(&pa) & POLLIN) && aio_return(&ra) == 4;
+	read(p[0], buf, 1);
+	ok &= e;
+	printf("pipe + file: %s\n", e ? "ok" : "FAILED");
+
+	/* A socket that is writable right away, with a signal */
+	signal(SIGUSR1, count);
+	poll_cb(&sa, s[0]);
+	sa.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+	sa.aio_sigevent.sigev_signo = SIGUSR1;
+	if (aio_poll(&sa, POLLOUT) < 0)
+		die("aio_poll");
+	for (i = 0; i < 5000 && !signals; ++i)
+		nanosleep(&ms, NULL);
+	e = signals == 1 && aio_error_fast(&sa) == 0 && aio_return(&sa) == POLLOUT;
+	ok &= e;
+	printf("socket writable, signal: %s\n", e ? "ok" : "FAILED");
+
+	/* Poll with a timeout */
+	poll_cb(&pa, p[0]);
+	if (aio_poll(&pa, POLLIN) < 0)
+		die("aio_poll");
+	aio_deadline(&pa, &to);
+	both[1] = &pa;
+	wait_all(both + 1, 1);
+	e = aio_error(&pa) == ETIMEDOUT && aio_return(&pa) == -1;
+	ok &= e;
+	printf("timeout: %s\n", e ? "ok" : "FAILED");
+
+	/* Deadlines set out of order, and one taken back again */
+	for (i = 0; i < 3; ++i) {
+		poll_cb(&pl[i], p[0]);
+		if (aio_poll(&pl[i], POLLIN) < 0)
+			die("aio_poll");
+	}
+	aio_deadline(&pl[0], &to);
+	aio_deadline(&pl[2], &to2);
+	aio_deadline(&pl[1], &to2);
+	aio_deadline(&pl[2], NULL);
+	wait_all(two, 2);
+	e = aio_error(&pl[0]) == ETIMEDOUT && aio_error(&pl[1]) == ETIMEDOUT;
+	nanosleep(&to, NULL);
+	e = e && aio_error(&pl[2]) == EINPROGRESS && aio_cancel(p[0], &pl[2]) == AIO_CANCELED;
+	two[0] = &pl[2];
+	wait_all(two, 1);
+	for (i = 0; i < 3; ++i)
+		aio_return(&pl[i]);
+	ok &= e;
+	printf("deadlines out of order: %s\n", e ? "ok" : "FAILED");
+
+	/* Polls in the kernel can always be cancelled */
+	poll_cb(&pa, p[0]);
+	if (aio_poll(&pa, POLLIN) < 0)
+		die("aio_poll");
+	nanosleep(&ms, NULL);
+	e = aio_cancel(p[0], &pa) == AIO_CANCELED;
+	wait_all(both + 1, 1);
+	e = e && aio_error(&pa) == ECANCELED && aio_return(&pa) == -1;
+	ok &= e;
+	printf("cancel: %s\n", e ? "ok" : "FAILED");
+
+	/* Hangup is reported even if not asked for */
+	poll_cb(&sa, s[0]);
+	if (aio_poll(&sa, POLLIN) < 0)
+		die("aio_poll");
+	close(s[1]);
+	both[1] = &sa;
+	wait_all(both + 1, 1);
+	e = aio_error(&sa) == 0 && (aio_return(&sa) & (POLLHUP|POLLIN));
+	ok &= e;
+	printf("hangup: %s\n", e ? "ok" : "FAILED");
+
+	close(p[0]);
+	close(p[1]);
+	close(s[0]);
+	close(file);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+/* test module for aio_files, reading many small files, on io_uring and on
+ * the worker pool
+ */
+#define _GNU_SOURCE
+#include "../aio_files.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	FILES = 300,
+	BUFSIZE = 4096,
+	BIG = 10000,
+	DEPTH = 16,
+	BATCH = 32
+};
+
+
+static char dir[] = "/tmp/aio_files.XXXXXX";
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+size_t file_size(int i)
+{
+	return (i*37) % BUFSIZE;
+}
+
+
+char file_byte(int i, size_t off)
+{
+	return 'a' + (i + off) % 26;
+}
+
+
+void make_tree(int dfd)
+{
+	char name[64], *p = malloc(BIG);
+	size_t j = 0;
+	int i = 0, fd = -1;
+
+	for (i = 0; i < FILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		if ((fd = openat(dfd, name, O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
+			die("openat");
+		for (j = 0; j < file_size(i); ++j)
+			p[j] = file_byte(i, j);
+		write(fd, p, file_size(i));
+		close(fd);
+	}
+	if ((fd = openat(dfd, "big", O_RDWR|O_CREAT|O_TRUNC, 0600)) < 0)
+		die("openat");
+	memset(p, 'B', BIG);
+	write(fd, p, BIG);
+	close(fd);
+	mkdirat(dfd, "sub", 0700);
+	free(p);
+}
+
+
+void remove_tree(int dfd)
+{
+	char name[64];
+	int i = 0;
+
+	for (i = 0; i < FILES; ++i) {
+		snprintf(name, sizeof(name), "f%d", i);
+		unlinkat(dfd, name, 0);
+	}
+	unlinkat(dfd, "big", 0);
+	unlinkat(dfd, "sub", AT_REMOVEDIR);
+	rmdir(dir);
+}
+
+
+/* Read the tree plus a file too large for its buffer, a missing one and a
+ * directory, submitting in batches while reaping.
+ */
+int run(int dfd, int flags)
+{
+	struct aio_files *q = NULL;
+	struct aio_file *fs = calloc(FILES + 3, sizeof(struct aio_file));
+	struct aio_file *list[BATCH], *done[BATCH];
+	struct timespec zero = {0, 0};
+	char *bufs = malloc((FILES + 3)*BUFSIZE), names[FILES][16];
+	int i = 0, j = 0, n = 0, reaped = 0, bad = 0, submitted = 0, ok = 1, lowest = dup(0);
+	size_t k = 0;
+
+	close(lowest);
+	if ((q = aio_files_open(DEPTH, flags)) == NULL)
+		die("aio_files_open");
+	ok &= aio_files_reap(q, done, BATCH, &zero) == 0;
+
+	for (i = 0; i < FILES + 3; ++i) {
+		fs[i].dirfd = dfd;
+		fs[i].buf = bufs + i*BUFSIZE;
+		fs[i].len = BUFSIZE;
+		fs[i].data = (void *)(intptr_t)i;
+		if (i < FILES) {
+			snprintf(names[i], sizeof(names[i]), "f%d", i);
+			fs[i].path = names[i];
+		}
+	}
+	fs[FILES].path = "big";
+	fs[FILES + 1].path = "missing";
+	fs[FILES + 2].path = "sub";
+
+	while (reaped < FILES + 3) {
+		for (n = 0; n < BATCH && submitted < FILES + 3; ++n)
+			list[n] = &fs[submitted++];
+		if (n > 0 && aio_files_submit(q, list, n) < 0)
+			die("aio_files_submit");
+		if ((n = aio_files_reap(q, done, BATCH, NULL)) < 0)
+			die("aio_files_reap");
+		for (j = 0; j < n; ++j) {
+			i = (intptr_t)done[j]->data;
+			if (i < FILES) {
+				bad += done[j]->error != 0 || done[j]->nread != (ssize_t)file_size(i) ||
+				       done[j]->st.st_size != (off_t)file_size(i) || !S_ISREG(done[j]->st.st_mode);
+				for (k = 0; k < file_size(i) && !bad; ++k)
+					bad += ((char *)done[j]->buf)[k] != file_byte(i, k);
+			}
+		}
+		reaped += n;
+	}
+	ok &= bad == 0 && aio_files_pending(q) == 0;
+	ok &= fs[FILES].error == 0 && fs[FILES].nread == BUFSIZE && fs[FILES].st.st_size == BIG;
+	ok &= fs[FILES + 1].error == ENOENT;
+	ok &= fs[FILES + 2].error == EISDIR;
+
+	/* a second round on the same queue, slots must all be free again */
+	for (i = 0; i < FILES; i += n) {
+		for (n = 0; n < BATCH && i + n < FILES; ++n)
+			list[n] = &fs[i + n];
+		aio_files_submit(q, list, n);
+	}
+	for (reaped = 0; (n = aio_files_reap(q, done, BATCH, NULL)) > 0;)
+		reaped += n;
+	ok &= reaped == FILES;
+
+	printf("%s: %d files, %d bad: %s\n", aio_files_uring(q) ? "io_uring" : "worker pool",
+	       FILES + 3, bad, ok ? "ok" : "FAILED");
+	aio_files_close(q);
+
+	/* every file opened got closed, also those that failed to read */
+	ok &= (j = dup(0)) == lowest;
+	close(j);
+	printf("%s fds: %s\n", flags & AIO_FILES_POOL ? "worker pool" : "io_uring", j == lowest ? "ok" : "LEAKED");
+	free(fs);
+	free(bufs);
+	return ok;
+}
+
+
+int main()
+{
+	int dfd = -1, ok = 1;
+
+	if (mkdtemp(dir) == NULL)
+		die("mkdtemp");
+	if ((dfd = open(dir, O_RDONLY|O_DIRECTORY)) < 0)
+		die("open");
+	make_tree(dfd);
+
+	ok &= run(dfd, 0);
+	ok &= run(dfd, AIO_FILES_POOL);
+
+	remove_tree(dfd);
+	close(dfd);
+	return ok ? 0 : 1;
+}
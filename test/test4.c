@@ -0,0 +1,64 @@
+/* test module for aio implementation for the aio_stream_* reader */
+#include "../aio_stream.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int main()
+{
+	int fd;
+	ssize_t n = 0;
+	size_t off = 0, total = 0;
+	struct stat st;
+	char *buf = NULL;
+	void *chunk = NULL;
+	struct aio_stream *s = NULL;
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	buf = calloc(1, st.st_size + 1);
+	if (pread(fd, buf, st.st_size, 0) != st.st_size)
+		die("pread");
+
+	/* small odd sized chunks to get a lot of them, read until EOF */
+	if ((s = aio_stream_open(fd, 0, 0, 61, 8, 0)) == NULL)
+		die("aio_stream_open");
+
+	while ((n = aio_stream_next(s, &chunk, &off)) > 0) {
+		if (off != total || memcmp(buf + off, chunk, n) != 0) {
+			fprintf(stderr, "mismatch at offset %zu\n", off);
+			exit(1);
+		}
+		fwrite(chunk, 1, n, stdout);
+		total += n;
+		aio_stream_release(s, chunk);
+	}
+	if (n < 0)
+		die("aio_stream_next");
+	aio_stream_close(s);
+
+	printf("Streamed %zu of %zu bytes: %s\n", total, (size_t)st.st_size,
+	       total == (size_t)st.st_size ? "ok" : "MISMATCH");
+	free(buf);
+	return 0;
+}
+
@@ -0,0 +1,148 @@
+/* test module for aio implementation for aio_copy() */
+#define _GNU_SOURCE
+#include "../aio_copy.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int progress(size_t done, size_t total, void *arg)
+{
+	++*(int *)arg;
+	return 0;
+}
+
+
+int check(const char *what, int in, int out, size_t size, int flags)
+{
+	int calls = 0;
+	ssize_t r = 0;
+	char *a = calloc(1, size), *b = calloc(1, size);
+	struct aio_copy_opt opt = {64, 4, flags, progress, &calls};
+
+	ftruncate(out, 0);
+	if ((r = aio_copy(in, 0, out, 0, 0, &opt)) < 0)
+		die("aio_copy");
+	pread(in, a, size, 0);
+	pread(out, b, size, 0);
+	printf("%s: copied %zd of %zu bytes in %d steps: %s\n", what, r, size, calls,
+	       (size_t)r == size && memcmp(a, b, size) == 0 ? "ok" : "MISMATCH");
+	free(a);
+	free(b);
+	return 0;
+}
+
+
+/* A 4M file with two data blocks and a zero block, the rest are holes */
+int check_sparse(int out)
+{
+	int in, calls = 0;
+	ssize_t r = 0;
+	struct stat ist, ost;
+	char tmpl[] = "/tmp/aio_sparse.XXXXXX", *a = NULL, *b = NULL;
+	struct aio_copy_opt opt = {64*1024, 4, AIO_COPY_SPARSE, progress, &calls};
+	size_t size = 4*1024*1024;
+
+	if ((in = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	a = calloc(1, size);
+	b = calloc(1, size);
+	memset(a + 4096, 'A', 4096);
+	memset(a + 2*1024*1024, 'B', 4096);
+	pwrite(in, a + 4096, 4096, 4096);
+	pwrite(in, a + 2*1024*1024, 4096, 2*1024*1024);
+	pwrite(in, a + 3*1024*1024, 64*1024, 3*1024*1024);
+	ftruncate(in, size);
+
+	ftruncate(out, 0);
+	if ((r = aio_copy(in, 0, out, 0, 0, &opt)) < 0)
+		die("aio_copy");
+	pread(out, b, size, 0);
+	fstat(in, &ist);
+	fstat(out, &ost);
+	printf("sparse: copied %zd of %zu bytes, %s, %s\n", r, size,
+	       (size_t)ost.st_size == size && memcmp(a, b, size) == 0 ? "ok" : "MISMATCH",
+	       ost.st_blocks < ist.st_blocks ? "holes kept" : "holes filled");
+	close(in);
+	free(a);
+	free(b);
+	return 0;
+}
+
+
+/* An O_DIRECT output ending in a partial block; its O_DIRECT must stay */
+int check_direct(int in, size_t size)
+{
+	int out, flags = 0;
+	ssize_t r = 0;
+	char tmpl[] = "/var/tmp/aio_direct.XXXXXX", *a = calloc(1, size), *b = calloc(1, size);
+	struct aio_copy_opt opt = {64*1024, 4, AIO_COPY_NOOFFLOAD, NULL, NULL};
+
+	/* tmpfs does not do O_DIRECT */
+	if ((out = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+	if (fcntl(out, F_SETFL, O_DIRECT) < 0) {
+		printf("direct: O_DIRECT not supported here, skipped\n");
+		close(out);
+		free(a);
+		free(b);
+		return 0;
+	}
+	if ((r = aio_copy(in, 0, out, 0, 0, &opt)) < 0)
+		die("aio_copy");
+	flags = fcntl(out, F_GETFL);
+	fcntl(out, F_SETFL, 0);
+	pread(in, a, size, 0);
+	pread(out, b, size, 0);
+	printf("direct: copied %zd of %zu bytes, %s, %s\n", r, size,
+	       (size_t)r == size && memcmp(a, b, size) == 0 ? "ok" : "MISMATCH",
+	       (flags & O_DIRECT) ? "O_DIRECT kept" : "O_DIRECT LOST");
+	close(out);
+	free(a);
+	free(b);
+	return 0;
+}
+
+
+int main()
+{
+	int in, out;
+	struct stat st;
+	char tmpl[] = "/tmp/aio_copy.XXXXXX";
+
+#ifdef ANDROID
+	if ((in = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((in = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(in, &st);
+
+	if ((out = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	unlink(tmpl);
+
+	check("ring", in, out, st.st_size, AIO_COPY_NOOFFLOAD);
+	check("offload", in, out, st.st_size, 0);
+	check_sparse(out);
+	check_direct(in, st.st_size);
+
+	close(out);
+	close(in);
+	return 0;
+}
+
@@ -0,0 +1,119 @@
+/* test module for aio implementation for aio_read_hook() and aio_digest_* */
+#include "../aio_digest.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+void hex(const char *what, const unsigned char *d, int n)
+{
+	int i = 0;
+
+	printf("%s: ", what);
+	for (i = 0; i < n; ++i)
+		printf("%02x", d[i]);
+	printf("\n");
+}
+
+
+/* the reference: hash everything in one go */
+int whole(int type, const char *buf, size_t n, unsigned char *out)
+{
+	uint32_t crc = 0;
+	struct aio_sha256 sha;
+	struct aio_blake3 b3;
+
+	if (type == AIO_DIGEST_CRC32C) {
+		crc = aio_crc32c(0, buf, n);
+		out[0] = crc >> 24; out[1] = crc >> 16; out[2] = crc >> 8; out[3] = crc;
+		return 4;
+	} else if (type == AIO_DIGEST_SHA256) {
+		aio_sha256_init(&sha);
+		aio_sha256_update(&sha, buf, n);
+		aio_sha256_final(&sha, out);
+	} else {
+		aio_blake3_init(&b3);
+		aio_blake3_update(&b3, buf, n);
+		aio_blake3_final(&b3, out);
+	}
+	return 32;
+}
+
+
+int main()
+{
+	int fd, i = 0, type = 0, n = 0, chunks = 0, e = 0;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL;
+	struct aio_digest *d = NULL;
+	unsigned char md[AIO_DIGEST_MAX], md2[AIO_DIGEST_MAX];
+	const char *names[] = {"crc32c", "sha256", "blake3"};
+	const size_t chunk = 100;
+
+	/* known answers */
+	printf("crc32c(123456789) = %08x (e3069283)\n", aio_crc32c(0, "123456789", 9));
+	whole(AIO_DIGEST_SHA256, "abc", 3, md);
+	hex("sha256(abc)", md, 32);
+	whole(AIO_DIGEST_BLAKE3, "abc", 3, md);
+	hex("blake3(abc)", md, 32);
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	ref = calloc(1, st.st_size);
+	if (pread(fd, ref, st.st_size, 0) != st.st_size)
+		die("pread");
+
+	/* one chunk more than needed, reading past EOF */
+	chunks = st.st_size/chunk + 2;
+	a = calloc(chunks, sizeof(*a));
+	buf = calloc(chunks, chunk);
+
+	for (type = AIO_DIGEST_CRC32C; type <= AIO_DIGEST_BLAKE3; ++type) {
+		if ((d = aio_digest_new(type, 0)) == NULL)
+			die("aio_digest_new");
+		memset(a, 0, chunks*sizeof(*a));
+		for (i = 0; i < chunks; ++i) {
+			a[i].aio_fildes = fd;
+			a[i].aio_buf = buf + i*chunk;
+			a[i].aio_nbytes = chunk;
+			a[i].aio_offset = i*chunk;
+			if (aio_read_hook(&a[i], aio_digest_hook, d) < 0)
+				die("aio_read_hook");
+		}
+		for (i = 0; i < chunks; ++i) {
+			while ((e = aio_error(&a[i])) == EINPROGRESS)
+				;
+			aio_return(&a[i]);
+		}
+		if ((n = aio_digest_final(d, md)) < 0)
+			die("aio_digest_final");
+		whole(type, ref, st.st_size, md2);
+		printf("%s: %s\n", names[type], memcmp(md, md2, n) == 0 ? "ok" : "MISMATCH");
+		aio_digest_free(d);
+	}
+
+	free(a);
+	free(buf);
+	free(ref);
+	return 0;
+}
+
@@ -0,0 +1,256 @@
+/* test module for aio implementation for aio_reqprio scheduling, limits and aio_deadline() */
+#define _GNU_SOURCE
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum {
+	CHUNK = 16,
+	BIG_CHUNK = 1024*1024,
+	BIG_CHUNKS = 16,
+	LIMIT_POLLS = 12
+};
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int wait_for(struct aiocb *a)
+{
+	const struct aiocb *cbl[1] = {a};
+	int e = 0;
+
+	while ((e = aio_error(a)) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	return e;
+}
+
+
+/* Queue uncached reads behind a single slot and let their deadlines hit
+ * right away. Requests which made it before are fine as well.
+ */
+int check_deadline(void)
+{
+	int fd, i = 0, e = 0, timedout = 0, done = 0;
+	char tmpl[] = "/tmp/aio_deadline.XXXXXX", *buf = NULL;
+	struct aiocb a[BIG_CHUNKS];
+	struct timespec now = {0, 0};
+
+	if ((fd = mkstemp(tmpl)) < 0)
+		die("mkstemp");
+	if (posix_memalign((void **)&buf, 4096, BIG_CHUNK*BIG_CHUNKS) != 0)
+		die("posix_memalign");
+	memset(buf, 'A', BIG_CHUNK*BIG_CHUNKS);
+	pwrite(fd, buf, BIG_CHUNK*BIG_CHUNKS, 0);
+	fsync(fd);
+	close(fd);
+
+	/* tmpfs does not do O_DIRECT */
+	if ((fd = open(tmpl, O_RDONLY|O_DIRECT)) < 0 && (fd = open(tmpl, O_RDONLY)) < 0)
+		die("open");
+	unlink(tmpl);
+
+	memset(a, 0, sizeof(a));
+	for (i = 0; i < BIG_CHUNKS; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*BIG_CHUNK;
+		a[i].aio_nbytes = BIG_CHUNK;
+		a[i].aio_offset = i*BIG_CHUNK;
+		a[i].aio_reqprio = 1;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	for (i = 0; i < BIG_CHUNKS; ++i) {
+		if (aio_deadline(&a[i], &now) < 0)
+			die("aio_deadline");
+	}
+	for (i = 0; i < BIG_CHUNKS; ++i) {
+		e = wait_for(&a[i]);
+		if (e == ETIMEDOUT && aio_return(&a[i]) == -1)
+			++timedout;
+		else if (e == 0 && aio_return(&a[i]) == BIG_CHUNK)
+			++done;
+	}
+	close(fd);
+	free(buf);
+
+	e = timedout + done == BIG_CHUNKS;
+	printf("deadline: %d timed out, %d finished before: %s\n", timedout, done, e ? "ok" : "FAILED");
+	return e;
+}
+
+
+/* Depths must stay within the limits, the rest waits in the queue. Polls
+ * on empty pipes stay in flight until we write, so the depths are exact.
+ */
+void poll_cb(struct aiocb *a, int fd)
+{
+	memset(a, 0, sizeof(*a));
+	a->aio_fildes = fd;
+	if (aio_poll(a, POLLIN) < 0)
+		die("aio_poll");
+}
+
+
+int check_limit(void)
+{
+	int p[2], q[2], i = 0, e = 0, ok = 1;
+	struct aiocb pa[LIMIT_POLLS], qa[LIMIT_POLLS/2];
+	struct aio_sched_stats fst, qst, pst;
+
+	if (pipe(p) < 0 || pipe(q) < 0)
+		die("pipe");
+	memset(&pa[0], 0, sizeof(pa[0]));
+	pa[0].aio_fildes = p[0];
+	if (aio_poll(&pa[0], POLLIN) < 0 && errno == EINVAL) {
+		printf("limit: IOCB_CMD_POLL not supported by this kernel, skipped\n");
+		return 1;
+	}
+	aio_cancel(p[0], &pa[0]);
+	wait_for(&pa[0]);
+	aio_return(&pa[0]);
+
+	/* 4 for p, and q gets what is left of the 8 for the process */
+	aio_sched_limit(p[0], 4);
+	aio_sched_limit(-1, 8);
+	for (i = 0; i < LIMIT_POLLS; ++i)
+		poll_cb(&pa[i], p[0]);
+	for (i = 0; i < LIMIT_POLLS/2; ++i)
+		poll_cb(&qa[i], q[0]);
+	aio_sched_stats(p[0], &fst);
+	aio_sched_stats(q[0], &qst);
+	aio_sched_stats(-1, &pst);
+	ok &= fst.inflight == 4 && fst.queued == LIMIT_POLLS - 4;
+	ok &= qst.inflight == 4 && qst.queued == LIMIT_POLLS/2 - 4;
+	ok &= pst.inflight == 8 && pst.queued == LIMIT_POLLS + LIMIT_POLLS/2 - 8;
+	printf("limit: %d + %d in flight, %d queued: %s\n", fst.inflight, qst.inflight, pst.queued,
+	       ok ? "ok" : "FAILED");
+
+	/* A queued request is cancelled without going to the kernel */
+	e = aio_cancel(p[0], &pa[LIMIT_POLLS - 1]) == AIO_CANCELED &&
+	    aio_error(&pa[LIMIT_POLLS - 1]) == ECANCELED && aio_return(&pa[LIMIT_POLLS - 1]) == -1;
+	aio_sched_stats(p[0], &fst);
+	e = e && fst.inflight == 4 && fst.queued == LIMIT_POLLS - 5;
+	ok &= e;
+	printf("cancel queued: %s\n", e ? "ok" : "FAILED");
+
+	/* The queued ones follow as the others finish */
+	write(p[1], "x", 1);
+	write(q[1], "x", 1);
+	for (i = 0; i < LIMIT_POLLS - 1; ++i) {
+		if (wait_for(&pa[i]) != 0 || !(aio_return(&pa[i]) & POLLIN))
+			ok = 0;
+	}
+	for (i = 0; i < LIMIT_POLLS/2; ++i) {
+		if (wait_for(&qa[i]) != 0 || !(aio_return(&qa[i]) & POLLIN))
+			ok = 0;
+	}
+	aio_sched_stats(-1, &pst);
+	e = ok && pst.inflight == 0 && pst.queued == 0;
+	printf("limit: %s\n", e ? "ok" : "FAILED");
+
+	aio_sched_limit(p[0], 0);
+	aio_sched_limit(-1, 0);
+	close(p[0]);
+	close(p[1]);
+	close(q[0]);
+	close(q[1]);
+	return e;
+}
+
+
+int main()
+{
+	int fd, i = 0, n = 0, timedout = 0, e = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL, bad;
+	struct timespec later = {10, 0};
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	n = (st.st_size + CHUNK - 1)/CHUNK;
+	a = calloc(n, sizeof(struct aiocb));
+	buf = calloc(1, st.st_size);
+	ref = calloc(1, st.st_size);
+	pread(fd, ref, st.st_size, 0);
+
+	memset(&bad, 0, sizeof(bad));
+	bad.aio_fildes = fd;
+	bad.aio_buf = buf;
+	bad.aio_nbytes = 1;
+	bad.aio_reqprio = -1;
+	if (aio_read(&bad) == 0 || errno != EINVAL)
+		ok = 0;
+	printf("negative aio_reqprio: %s\n", ok ? "EINVAL" : "accepted");
+
+	/* Only one low priority read at a time, mixed with unthrottled ones */
+	aio_sched_depth(1);
+	for (i = 0; i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		a[i].aio_reqprio = i % (AIO_PRIO_IDLE + 2);
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	for (i = 0; i < n; ++i) {
+		if (wait_for(&a[i]) != 0)
+			die("aio_error");
+		aio_return(&a[i]);
+	}
+	e = memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("prio: read %d chunks thru depth %d: %s\n", n, aio_sched_depth(0), e ? "ok" : "MISMATCH");
+
+	/* Generous deadlines must not fire */
+	memset(buf, 0, st.st_size);
+	for (i = 0; i < n; ++i) {
+		memset(&a[i], 0, sizeof(a[i]));
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		a[i].aio_reqprio = 1;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+		if (aio_deadline(&a[i], &later) < 0)
+			die("aio_deadline");
+	}
+	for (i = 0; i < n; ++i) {
+		if (wait_for(&a[i]) == ETIMEDOUT)
+			++timedout;
+		aio_return(&a[i]);
+	}
+	e = timedout == 0 && memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("deadline: %d of %d timed out early: %s\n", timedout, n, e ? "ok" : "FAILED");
+
+	ok &= check_deadline();
+	ok &= check_limit();
+
+	free(a);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+
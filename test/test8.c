@@ -0,0 +1,113 @@
+/* test module for aio implementation for aio_plug()/aio_unplug() */
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+enum { CHUNK = 8 };
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int zeros(const char *buf, size_t n)
+{
+	size_t i = 0, z = 0;
+
+	for (i = 0; i < n; ++i)
+		z += (buf[i] == 0);
+	return z;
+}
+
+
+int main()
+{
+	int fd, i = 0, n = 0, e = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL;
+	const struct aiocb *cbl[1];
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	n = (st.st_size + CHUNK - 1)/CHUNK;
+	a = calloc(n, sizeof(struct aiocb));
+	buf = calloc(1, st.st_size);
+	ref = calloc(1, st.st_size);
+	pread(fd, ref, st.st_size, 0);
+
+	/* Nothing must reach the kernel below the flush threshold */
+	aio_plug();
+	for (i = 0; i < 8 && i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	usleep(10000);
+	e = zeros(buf, i*CHUNK) == i*CHUNK;
+	ok &= e;
+	printf("plugged: %d requests held back: %s\n", i, e ? "ok" : "FAILED");
+
+	/* The rest flushes on its own every now and then */
+	for (; i < n; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = buf + i*CHUNK;
+		a[i].aio_nbytes = CHUNK;
+		a[i].aio_offset = i*CHUNK;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+	aio_unplug();
+
+	for (i = 0; i < n; ++i) {
+		cbl[0] = &a[i];
+		while (aio_error(&a[i]) == EINPROGRESS)
+			aio_suspend(cbl, 1, NULL);
+		aio_return(&a[i]);
+	}
+	e = memcmp(buf, ref, st.st_size) == 0;
+	ok &= e;
+	printf("unplugged: read %d chunks: %s\n", n, e ? "ok" : "MISMATCH");
+
+	/* Waiting while plugged must not hang */
+	memset(buf, 0, st.st_size);
+	aio_plug();
+	memset(&a[0], 0, sizeof(a[0]));
+	a[0].aio_fildes = fd;
+	a[0].aio_buf = buf;
+	a[0].aio_nbytes = CHUNK;
+	if (aio_read(&a[0]) < 0)
+		die("aio_read");
+	cbl[0] = &a[0];
+	while (aio_error(&a[0]) == EINPROGRESS)
+		aio_suspend(cbl, 1, NULL);
+	e = aio_return(&a[0]) == CHUNK;
+	aio_unplug();
+	ok &= e;
+	printf("suspend while plugged: %s\n", e ? "ok" : "FAILED");
+
+	free(a);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+
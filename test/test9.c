@@ -0,0 +1,69 @@
+/* test module for aio implementation for aio_error_fast() */
+#include "../aio.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+void die(const char *s)
+{
+	perror(s);
+	exit(errno);
+}
+
+
+int main()
+{
+	int fd, i = 0, left = 0, ok = 1;
+	struct stat st;
+	char *buf = NULL, *ref = NULL;
+	struct aiocb *a = NULL;
+
+#ifdef ANDROID
+	if ((fd = open("/etc/permissions/platform.xml", O_RDONLY)) < 0)
+#else
+	if ((fd = open("/etc/passwd", O_RDONLY)) < 0)
+#endif
+		die("open");
+	fstat(fd, &st);
+
+	a = calloc(st.st_size, sizeof(struct aiocb));
+	buf = calloc(1, st.st_size);
+	ref = calloc(1, st.st_size);
+	pread(fd, ref, st.st_size, 0);
+
+	for (i = 0; i < st.st_size; ++i) {
+		a[i].aio_fildes = fd;
+		a[i].aio_buf = &buf[i];
+		a[i].aio_nbytes = 1;
+		a[i].aio_offset = i;
+		if (aio_read(&a[i]) < 0)
+			die("aio_read");
+	}
+
+	/* Spin over all of them without calling into the library */
+	do {
+		for (i = 0, left = 0; i < st.st_size; ++i)
+			left += aio_error_fast(&a[i]) == EINPROGRESS;
+	} while (left > 0);
+
+	/* What the aiocb says must match what the library says */
+	for (i = 0; i < st.st_size; ++i) {
+		if (a[i].aio_error != 0 || a[i].aio_return != 1 ||
+		    aio_error(&a[i]) != 0 || aio_return(&a[i]) != 1)
+			ok = 0;
+	}
+	ok &= memcmp(buf, ref, st.st_size) == 0;
+	printf("aio_error_fast: %d requests: %s\n", (int)st.st_size, ok ? "ok" : "FAILED");
+
+	free(a);
+	free(buf);
+	free(ref);
+	return ok ? 0 : 1;
+}
+